@@ -0,0 +1,335 @@
+// Kernel and pipeline benchmarks: NNStockChessBench [name filter] [--reps N] [--data file] [--depth D]
+//
+// Every benchmark is timed for --reps repetitions after a warm-up run, each repetition long enough
+// (about 100ms) to swamp timer and scheduling noise. The median is reported together with the
+// spread (max - min) / median over the repetitions; spreads of more than a few percent mean the
+// machine was busy and the numbers should not be compared. Inputs come from fixed seeds, so two
+// runs on the same hardware measure the same work.
+
+#include "bitboard.h"
+#include "endgame.h"
+#include "movegen.h"
+#include "position.h"
+#include "psqt.h"
+#include "search.h"
+#include "thread.h"
+#include "tt.h"
+#include "uci.h"
+
+#include "features.hpp"
+#include "traindata.hpp"
+#include "trainer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace Stockfish;
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions {
+    std::string filter;
+    int reps = 7;
+    std::string data = "traindata.bin";
+    int depth = 10;
+} opts;
+
+double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/**
+ * Run fn (which does `work` units of something per call) until timings are stable, and print the
+ * median time per call and the throughput in units/s. Calls are batched into repetitions of at
+ * least min_rep_sec so that short kernels are not dominated by the clock. setup runs untimed before
+ * the warm-up and before every repetition.
+ */
+template <typename F, typename S>
+void run(const std::string &name, double work, const char *unit, F &&fn, double min_rep_sec, S &&setup) {
+    if (!opts.filter.empty() && name.find(opts.filter) == std::string::npos)
+        return;
+
+    // Warm-up, which also calibrates how many calls make up one repetition
+    setup();
+    auto start = Clock::now();
+    fn();
+    const double once = std::max(seconds_since(start), 1e-9);
+    const long calls = std::max(1L, long(min_rep_sec / once));
+
+    std::vector<double> per_call;
+    for (int r = 0; r < opts.reps; r++) {
+        setup();
+        start = Clock::now();
+        for (long c = 0; c < calls; c++)
+            fn();
+        per_call.push_back(seconds_since(start) / double(calls));
+    }
+
+    std::sort(per_call.begin(), per_call.end());
+    const double median = per_call[per_call.size() / 2];
+    const double spread = (per_call.back() - per_call.front()) / median * 100;
+
+    std::printf("%-40s %12.3f us/call %14.3f %-10s spread %5.1f%%\n", name.c_str(), median * 1e6,
+                work / median, unit, spread);
+    std::fflush(stdout);
+}
+
+template <typename F>
+void run(const std::string &name, double work, const char *unit, F &&fn, double min_rep_sec = 0.1) {
+    run(name, work, unit, std::forward<F>(fn), min_rep_sec, [] {});
+}
+
+template <typename T, int R, int C>
+Matrix<T, R, C> random_matrix(Arena &arena, std::mt19937_64 &rng) {
+    auto m = arena.take<T, R, C>(Arena::STATE);
+    std::uniform_real_distribution<T> dist(-1, 1);
+    for (std::size_t i = 0; i < m.size; i++)
+        m.dat[i] = dist(rng);
+    return m;
+}
+
+// C = A * B for an M x K times K x N product, as Matrix::mul does it, with A stored as TA
+template <int M, int N, int K, typename TA = NumericT>
+void bench_gemm(const char *suffix = "") {
+    Arena arena{Arena::sum(Arena::footprint_of<NumericT, M, K>(Arena::STATE),
+                           Arena::footprint_of<TA, M, K>(Arena::STATE),
+                           Arena::footprint_of<NumericT, K, N>(Arena::STATE),
+                           Arena::footprint_of<NumericT, M, N>(Arena::STATE))};
+    std::mt19937_64 rng{1};
+    auto a = random_matrix<NumericT, M, K>(arena, rng);
+    auto stored = arena.take<TA, M, K>(Arena::STATE);
+    convert_row(a.dat, stored.dat, a.size);
+    auto b = random_matrix<NumericT, K, N>(arena, rng);
+    auto c = arena.take<NumericT, M, N>(Arena::STATE);
+
+    run("gemm " + std::to_string(M) + "x" + std::to_string(N) + "x" + std::to_string(K) + suffix,
+        2e-9 * M * N * K, "GFLOP/s", [&] { gemm_f32(M, N, K, stored.dat, K, 1, b.dat, N, 1, c.dat, N); });
+}
+
+// Forward and backward of a full MAX_BATCH batch through one fully connected layer shape
+template <typename L>
+void bench_layer(const char *name) {
+    constexpr int InpNo = L::Inp::rows, OutNo = L::outputs;
+
+    Arena arena{Arena::sum(L::footprint, L::Grads::footprint, L::State::footprint,
+                           Arena::footprint_of<NumericT, InpNo, MAX_BATCH>(Arena::STATE),
+                           Arena::footprint_of<NumericT, OutNo, MAX_BATCH>(Arena::STATE))};
+    L layer{arena};
+    typename L::Grads grads{arena};
+    typename L::State state{arena};
+
+    std::mt19937_64 rng{2};
+    layer.randomize();
+    state.input = random_matrix<NumericT, InpNo, MAX_BATCH>(arena, rng);
+    auto dCost_dAct = random_matrix<NumericT, OutNo, MAX_BATCH>(arena, rng);
+
+    const double flops = 2e-9 * InpNo * OutNo * MAX_BATCH;
+    run(std::string("layer ") + name + " forward", flops, "GFLOP/s", [&] { layer.forward(state, MAX_BATCH); });
+    run(std::string("layer ") + name + " backward", 2 * flops, "GFLOP/s",
+        [&] { layer.backward(state, grads, dCost_dAct, MAX_BATCH); });
+
+    // One optimizer step over every parameter; num_backprops is reset by each step
+    std::vector<NumericT> moments[OPTIM_SLOTS];
+    for (int s = 0; s < OPTIM_SLOTS; s++) {
+        moments[s].assign(layer.weights.size + layer.biases.size, 0);
+        layer.weight_moments[s].dat = moments[s].data();
+        layer.bias_moments[s].dat = moments[s].data() + layer.weights.size;
+    }
+
+    const double params = double(layer.weights.size + layer.biases.size);
+    for (const auto &[opt, label]: {std::pair{Optimizer::sgd(), "sgd"}, {Optimizer::with_momentum(), "momentum"},
+                                    {Optimizer::adam(), "adam"}}) {
+        const OptimStep s = OptimStep::of(opt, 1, 1);
+        run(std::string("layer ") + name + " step " + label, params, "params/s", [&] {
+            grads.num_backprops = MAX_BATCH;
+            layer.apply_backprop(grads, s);
+        });
+    }
+}
+
+// Positions from random playouts, the same ones on every run
+std::vector<std::string> sample_fens(int n) {
+    std::mt19937_64 rng{3};
+    std::vector<std::string> fens;
+
+    while (int(fens.size()) < n) {
+        StateListPtr states{new std::deque<StateInfo>(1)};
+        Position pos;
+        pos.set("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", false, &states->back(), nullptr);
+
+        const int plies = int(rng() % 60);
+        for (int p = 0; p < plies; p++) {
+            const MoveList<LEGAL> moves(pos);
+            if (moves.size() == 0) break;
+            states->emplace_back();
+            pos.do_move(*(moves.begin() + rng() % moves.size()), states->back());
+        }
+
+        if (MoveList<LEGAL>(pos).size() > 0)
+            fens.push_back(pos.fen());
+    }
+    return fens;
+}
+
+// Puzzle-like lines: a start position from a random game and the next plies moves, as UCI
+std::vector<std::pair<std::string, std::string>> sample_lines(int n, int plies) {
+    std::mt19937_64 rng{5};
+    std::vector<std::pair<std::string, std::string>> lines;
+
+    while (int(lines.size()) < n) {
+        StateListPtr states{new std::deque<StateInfo>(1)};
+        Position pos;
+        pos.set("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", false, &states->back(), nullptr);
+
+        const int opening = int(rng() % 40);
+        std::string fen, moves;
+        for (int p = 0; p < opening + plies; p++) {
+            const MoveList<LEGAL> legal(pos);
+            if (legal.size() == 0) break;
+            if (p == opening) fen = pos.fen();
+
+            const Move m = *(legal.begin() + rng() % legal.size());
+            if (p >= opening) moves += (moves.empty() ? "" : " ") + UCI::move(m, false);
+            states->emplace_back();
+            pos.do_move(m, states->back());
+        }
+
+        if (!fen.empty() && MoveList<LEGAL>(pos).size() > 0 &&
+            std::count(moves.begin(), moves.end(), ' ') == plies - 1)
+            lines.emplace_back(fen, moves);
+    }
+    return lines;
+}
+
+void bench_network(const std::vector<std::string> &fens) {
+    Trainer trainer{};
+    trainer.net = std::make_unique<Network>();
+    Network &net = *trainer.net;
+
+    std::vector<BoardFeatures> features(fens.size());
+    for (std::size_t i = 0; i < fens.size(); i++) {
+        trainer.position_fen(fens[i]);
+        encode_features(trainer.pos, features[i]);
+    }
+
+    // The sparse first layer on its own
+    Network::Worker &w = net.main_worker();
+    std::copy_n(features.begin(), MAX_BATCH, w.inp);
+    run("layer hid1 forward (sparse)", MAX_BATCH, "samples/s", [&] { net.hid1.forward(w.hid1, MAX_BATCH); });
+
+    BoardFeatures scratch;
+    run("encode_features", 1, "encodes/s", [&] { encode_features(trainer.pos, scratch); });
+
+    // Single positions through the incremental first layer, as train_line_here() evaluates them
+    std::size_t next = 0;
+    run("eval_forward", 1, "evals/s", [&] {
+        trainer.position_fen(fens[next]);
+        trainer.eval_forward();
+        next = (next + 1) % fens.size();
+    });
+
+    std::vector<std::array<NumericT, 2>> outputs(features.size());
+    run("evaluate_batch", double(features.size()), "evals/s",
+        [&] { net.evaluate_batch(w, features.data(), int(features.size()), outputs.data()); });
+}
+
+void bench_load(const std::string &file) {
+    std::error_code ec;
+    const auto bytes = std::filesystem::file_size(file, ec);
+    if (ec) {
+        std::printf("%-40s skipped, %s not found (--data)\n", "Dataset::load_from_bin", file.c_str());
+        return;
+    }
+
+    // One load per repetition; the file is in the page cache after the warm-up
+    run("Dataset::load_from_bin", double(bytes) / (1 << 20), "MB/s", [&] {
+        Dataset set;
+        set.load_from_bin(file);
+    }, 0);
+}
+
+void bench_labels(const std::vector<std::string> &fens) {
+    Trainer trainer{};
+    trainer.budget.min_depth = trainer.budget.max_depth = opts.depth;
+
+    const int n = 8;
+    // With no minimum repetition time every repetition is one call, and the TT and history tables
+    // it starts from are cleared (untimed) first, so every repetition does the same search
+    run("stockfish_eval depth " + std::to_string(opts.depth), n, "labels/s", [&] {
+        for (int i = 0; i < n; i++) {
+            trainer.position_fen(fens[i]);
+            trainer.stockfish_eval();
+        }
+    }, 0, [] { Search::clear(); });
+
+    // Every ply of the same lines, each repetition from a cleared TT, with and without the move
+    // history: what SearchStart::WARM costs or saves over COLD on identical positions
+    const int plies = 4;
+    const auto lines = sample_lines(4, plies);
+    for (const SearchStart start: {SearchStart::COLD, SearchStart::WARM}) {
+        trainer.search_start = start;
+        const std::string mode = start == SearchStart::WARM ? "warm" : "cold";
+        run("stockfish_eval line " + mode + " depth " + std::to_string(opts.depth), double(lines.size()) * (plies + 1),
+            "labels/s", [&] {
+                for (const auto &[fen, moves]: lines)
+                    trainer.position_fen(fen, moves, [&] { trainer.stockfish_eval(); });
+            }, 0, [] { Search::clear(); });
+    }
+}
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--reps" && i + 1 < argc) opts.reps = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--data" && i + 1 < argc) opts.data = argv[++i];
+        else if (arg == "--depth" && i + 1 < argc) opts.depth = std::atoi(argv[++i]);
+        else opts.filter = arg;
+    }
+
+    std::cout << engine_info() << std::endl;
+
+    CommandLine::init(argc, argv);
+    UCI::init(Options);
+    Tune::init();
+    PSQT::init();
+    Bitboards::init();
+    Position::init();
+    Bitbases::init();
+    Endgames::init();
+    // A small fixed TT, whatever the UCI default, so clearing it is cheap and label timings do not
+    // depend on how much of it a search can fill
+    Options["Hash"] = std::string("16");
+    Threads.set(size_t(Options["Threads"]));
+    Search::clear(); // After threads are up
+    Eval::NNUE::init();
+
+    bench_gemm<256, 256, 256>();
+    bench_gemm<1024, 1024, 1024>();
+    bench_gemm<L2_SIZE, MAX_BATCH, INP_SIZE>();
+    bench_gemm<L2_SIZE, MAX_BATCH, INP_SIZE, bf16>(" bf16");
+    bench_gemm<L2_SIZE, MAX_BATCH, INP_SIZE, fp16>(" fp16");
+    bench_gemm<L2_SIZE, 1, INP_SIZE>();
+    bench_gemm<L2_SIZE, 1, INP_SIZE, bf16>(" bf16");
+
+    bench_layer<Network::Hid2>("hid2");
+    bench_layer<Network::Hid3>("hid3");
+    bench_layer<Network::Hid4>("hid4");
+    bench_layer<Network::Out>("out");
+
+    const auto fens = sample_fens(256);
+    bench_network(fens);
+    bench_load(opts.data);
+    bench_labels(fens);
+
+    Threads.set(0);
+    return 0;
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <vector>
+
+#include "evaluate.h"
+#include "position.h"
+
+#include "features.hpp"
+
+using namespace Stockfish;
+
+/**
+ * Incrementally updated first-layer pre-activations, NNUE style.
+ *
+ * One entry per ply of the current line holds biases plus the weight rows of every piece and
+ * castling feature, from both perspectives, since the side to move decides which half of the input
+ * a piece lands in. A move only touches the 2-4 pieces in StateInfo::dirtyPiece and maybe a castling
+ * right, so push() derives the new entry from the previous one with a handful of row adds. The
+ * en passant square and the halfmove clock change on nearly every move and are added in evaluate().
+ *
+ * Entries remember the layer generation they were computed with; after apply_backprop() changes the
+ * weights, stale entries are simply recomputed from the position the first time they are needed.
+ */
+template <typename InputLayer>
+class AccumulatorStack {
+public:
+    constexpr static int OutNo = InputLayer::outputs;
+
+    struct Entry {
+        NumericT z[COLOR_NB][OutNo];
+        unsigned generation;
+    };
+
+    explicit AccumulatorStack(const InputLayer *l = nullptr) : layer(l) {}
+
+    void bind(const InputLayer *l) {
+        layer = l;
+        reset();
+    }
+
+    [[nodiscard]] const InputLayer *bound() const {
+        return layer;
+    }
+
+    // Forget the line; the next evaluate() or push() starts from scratch
+    void reset() {
+        top = 0;
+    }
+
+    // Call right after pos.do_move()
+    void push(const Position &pos) {
+        if (top == stack.size())
+            stack.emplace_back();
+
+        Entry &cur = stack[top++];
+        if (!layer) {
+            cur.generation = ~0u; // nothing to update yet, only keep the depth in sync
+            return;
+        }
+
+        if (top < 2 || !Eval::useNNUE || stack[top - 2].generation != layer->generation) {
+            refresh(pos, cur);
+            return;
+        }
+
+        const Entry &prev = stack[top - 2];
+        const StateInfo *st = pos.state();
+        const DirtyPiece &dp = st->dirtyPiece;
+
+        for (Color persp : {WHITE, BLACK}) {
+            NumericT *z = cur.z[persp];
+            std::copy_n(prev.z[persp], OutNo, z);
+
+            for (int k = 0; k < dp.dirty_num; k++) {
+                const Color c = color_of(dp.piece[k]);
+                const PieceType pt = type_of(dp.piece[k]);
+
+                if (dp.from[k] != SQ_NONE)
+                    sub_row(z, piece_feature(persp, c, pt, dp.from[k]));
+                if (dp.to[k] != SQ_NONE)
+                    add_row(z, piece_feature(persp, c, pt, dp.to[k]));
+            }
+
+            const int lost = st->previous->castlingRights & ~st->castlingRights;
+            for (Color c : {WHITE, BLACK}) {
+                if (lost & c_rights(c, false))
+                    sub_row(z, castling_feature(persp, c, false));
+                if (lost & c_rights(c, true))
+                    sub_row(z, castling_feature(persp, c, true));
+            }
+        }
+
+        cur.generation = layer->generation;
+    }
+
+    // Call right after pos.undo_move()
+    void pop() {
+        if (top > 0)
+            top--;
+    }
+
+    // z = first-layer pre-activation of pos, which must be the position of the last push()
+    void evaluate(const Position &pos, NumericT *z) {
+        if (top == 0)
+            push(pos);
+
+        Entry &cur = stack[top - 1];
+        if (cur.generation != layer->generation)
+            refresh(pos, cur);
+
+        std::copy_n(cur.z[pos.side_to_move()], OutNo, z);
+
+        if (pos.ep_square() != SQ_NONE)
+            add_row(z, ep_feature(pos.ep_square()));
+
+        const NumericT *row = layer->weights[RULE50_FEATURE];
+        const NumericT rule50 = pos.rule50_count() / 50.0;
+        for (int i = 0; i < OutNo; i++)
+            z[i] += row[i] * rule50;
+    }
+
+private:
+    const InputLayer *layer;
+    std::vector<Entry> stack;
+    std::size_t top = 0;
+
+    static constexpr int c_rights(Color c, bool king_side) {
+        return (king_side ? KING_SIDE : QUEEN_SIDE) & (c == WHITE ? WHITE_OO | WHITE_OOO : BLACK_OO | BLACK_OOO);
+    }
+
+    void add_row(NumericT *z, int feature) const {
+        const NumericT *row = layer->weights[feature];
+        for (int i = 0; i < OutNo; i++)
+            z[i] += row[i];
+    }
+
+    void sub_row(NumericT *z, int feature) const {
+        const NumericT *row = layer->weights[feature];
+        for (int i = 0; i < OutNo; i++)
+            z[i] -= row[i];
+    }
+
+    void refresh(const Position &pos, Entry &e) const {
+        for (Color persp : {WHITE, BLACK}) {
+            NumericT *z = e.z[persp];
+            for (int i = 0; i < OutNo; i++)
+                z[i] = layer->biases[i][0];
+
+            for (Color c : {WHITE, BLACK}) {
+                for (PieceType pt : {PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING}) {
+                    Bitboard bb = pos.pieces(c, pt);
+                    while (bb)
+                        add_row(z, piece_feature(persp, c, pt, pop_lsb(bb)));
+                }
+
+                if (pos.castling_rights(c) & QUEEN_SIDE)
+                    add_row(z, castling_feature(persp, c, false));
+                if (pos.castling_rights(c) & KING_SIDE)
+                    add_row(z, castling_feature(persp, c, true));
+            }
+        }
+
+        e.generation = layer->generation;
+    }
+};
@@ -0,0 +1,53 @@
+#include "atomic_file.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+bool write_all(int fd, const void *data, std::size_t n) {
+    auto *p = static_cast<const char *>(data);
+    while (n > 0) {
+        ssize_t w = ::write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+int open_temporary(const std::string &path) {
+    const std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        std::cerr << "Cannot open " << tmp << ": " << std::strerror(errno) << '\n';
+    return fd;
+}
+
+bool commit_temporary(int fd, const std::string &path, bool ok) {
+    ok = ok && ::fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+
+    const std::string tmp = path + ".tmp";
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::cerr << "Failed to write " << path << ": " << std::strerror(errno) << '\n';
+        ::unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool write_atomically(const std::string &path, const void *header, std::size_t header_bytes,
+                      const void *payload, std::size_t bytes) {
+    int fd = open_temporary(path);
+    if (fd < 0) return false;
+
+    return commit_temporary(fd, path, write_all(fd, header, header_bytes) && write_all(fd, payload, bytes));
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/**
+ * Crash-safe file replacement: everything is written to path + ".tmp", fsynced and renamed over
+ * path, so a crash at any point leaves either the old or the new file, never a torn one. Failures
+ * are explained on std::cerr and leave no temporary behind.
+ */
+
+// Write all n bytes, retrying short writes and EINTR
+bool write_all(int fd, const void *data, std::size_t n);
+
+// Create (or truncate) path + ".tmp" for writing; -1 on failure
+int open_temporary(const std::string &path);
+
+// fsync and close fd, opened by open_temporary(path), and rename it over path if that and ok succeed
+bool commit_temporary(int fd, const std::string &path, bool ok = true);
+
+// Replace path with header_bytes of header followed by bytes of payload; either may be empty
+bool write_atomically(const std::string &path, const void *header, std::size_t header_bytes,
+                      const void *payload, std::size_t bytes);
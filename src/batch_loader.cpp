@@ -0,0 +1,131 @@
+#include "batch_loader.hpp"
+
+#include <chrono>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+std::uint64_t ns_since(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+// Spin briefly, then yield, then sleep: waits are expected to be short but must not burn a core
+void backoff(int &spins) {
+    if (++spins < 64)
+        return;
+    if (spins < 256)
+        std::this_thread::yield();
+    else
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+}
+
+BatchLoader::BatchLoader(EpochSampler &s, std::mt19937_64 &r, int num_epochs, int batch, Decode fn,
+                         int threads, std::size_t depth)
+        : sampler(s), rng(r), epochs(num_epochs), batch_size(std::max(batch, 1)), decode(std::move(fn)),
+          ready(depth), spare(depth * 2), running(std::max(threads, 1)) {
+    for (int t = 0; t < std::max(threads, 1); t++)
+        producers.emplace_back([this, t] { produce(t); });
+}
+
+BatchLoader::~BatchLoader() {
+    stopping = true;
+    for (auto &th : producers)
+        th.join();
+}
+
+bool BatchLoader::claim(std::vector<std::uint32_t> &indices, int &batch_epoch) {
+    std::unique_lock<std::mutex> lg(claim_mtx);
+    if (!order || cursor == order->size()) {
+        if (epoch + 1 >= epochs)
+            return false;
+        order = &sampler.next_epoch(rng);
+        cursor = 0;
+        epoch++;
+        if (order->empty())
+            return false;
+    }
+
+    const std::size_t n = std::min<std::size_t>(batch_size, order->size() - cursor);
+    indices.assign(order->begin() + std::ptrdiff_t(cursor), order->begin() + std::ptrdiff_t(cursor + n));
+    cursor += n;
+    batch_epoch = epoch;
+    return true;
+}
+
+bool BatchLoader::push(std::unique_ptr<PreparedBatch> &batch) {
+    const auto start = Clock::now();
+    int spins = 0;
+    while (!ready.try_push(batch)) {
+        if (stopping) return false;
+        backoff(spins);
+    }
+    if (spins > 0)
+        producer_stall_ns += ns_since(start);
+    return true;
+}
+
+void BatchLoader::produce(int thread) {
+    std::vector<std::uint32_t> indices;
+    while (!stopping) {
+        int batch_epoch;
+        if (!claim(indices, batch_epoch))
+            break;
+
+        std::unique_ptr<PreparedBatch> batch;
+        if (!spare.try_pop(batch))
+            batch = std::make_unique<PreparedBatch>();
+
+        batch->epoch = batch_epoch;
+        batch->inputs.resize(indices.size());
+        batch->labels.resize(indices.size());
+        for (std::size_t k = 0; k < indices.size(); k++)
+            decode(indices[k], thread, batch->inputs[k], batch->labels[k]);
+
+        if (!push(batch))
+            return;
+    }
+
+    // The last producer out tells the consumer there is nothing more
+    if (running.fetch_sub(1) == 1) {
+        std::unique_ptr<PreparedBatch> end;
+        push(end);
+    }
+}
+
+std::unique_ptr<PreparedBatch> BatchLoader::next() {
+    if (finished) return nullptr;
+
+    const std::size_t depth = ready.size_approx();
+    const auto start = Clock::now();
+    int spins = 0;
+
+    std::unique_ptr<PreparedBatch> batch;
+    while (!ready.try_pop(batch))
+        backoff(spins);
+    if (spins > 0)
+        consumer_stall_ns += ns_since(start);
+
+    if (!batch) {
+        finished = true;
+    } else {
+        batches++;
+        depth_sum += depth;
+    }
+    return batch;
+}
+
+void BatchLoader::recycle(std::unique_ptr<PreparedBatch> batch) {
+    if (batch)
+        spare.try_push(batch); // dropped if the spare queue is full
+}
+
+LoaderStats BatchLoader::stats() const {
+    LoaderStats s{};
+    s.batches = batches;
+    s.consumer_stall_sec = double(consumer_stall_ns) * 1e-9;
+    s.producer_stall_sec = double(producer_stall_ns.load()) * 1e-9;
+    s.mean_depth = batches ? double(depth_sum) / double(batches) : 0;
+    s.capacity = ready.capacity();
+    return s;
+}
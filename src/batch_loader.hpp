@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.hpp"
+#include "features.hpp"
+#include "sampler.hpp"
+
+// Decoded samples, ready to be swapped into Trainer's pending batch
+struct PreparedBatch {
+    std::vector<BoardFeatures> inputs;
+    std::vector<std::array<NumericT, 2>> labels;
+    int epoch = 0;
+};
+
+struct LoaderStats {
+    std::uint64_t batches = 0;
+    double consumer_stall_sec = 0; // time the training thread waited for a batch
+    double producer_stall_sec = 0; // time producers waited for room in the queue, summed over threads
+    double mean_depth = 0;         // ready batches in the queue when the training thread asked for one
+    std::size_t capacity = 0;
+};
+
+/**
+ * Background data pipeline: producer threads walk the sampler's epoch orders, decode samples
+ * into PreparedBatches and hand them to the training thread through a lock-free bounded queue.
+ * Consumed batches come back through a second queue, so their buffers are reused instead of
+ * reallocated. Only claiming a range of indices takes a lock; decoding runs in parallel.
+ *
+ * A consumer stall means the producers cannot keep up (add threads); producer stalls with a full
+ * queue mean the network is the bottleneck, as it should be.
+ */
+class BatchLoader {
+public:
+    // Fill features and label for sample index; thread identifies the calling producer for per-thread scratch
+    using Decode = std::function<void(std::uint32_t index, int thread, BoardFeatures &features,
+                                      std::array<NumericT, 2> &label)>;
+
+    BatchLoader(EpochSampler &sampler, std::mt19937_64 &rng, int epochs, int batch_size, Decode decode,
+                int threads = 2, std::size_t depth = 8);
+    ~BatchLoader();
+
+    BatchLoader(const BatchLoader &) = delete;
+    BatchLoader &operator=(const BatchLoader &) = delete;
+
+    // Next batch, or null once every epoch has been delivered. Hand batches back with recycle().
+    std::unique_ptr<PreparedBatch> next();
+
+    void recycle(std::unique_ptr<PreparedBatch> batch);
+
+    [[nodiscard]] LoaderStats stats() const;
+
+private:
+    EpochSampler &sampler;
+    std::mt19937_64 &rng;
+    const int epochs, batch_size;
+    Decode decode;
+
+    // Claiming state, guarded by claim_mtx
+    std::mutex claim_mtx;
+    const std::vector<std::uint32_t> *order = nullptr;
+    std::size_t cursor = 0;
+    int epoch = -1;
+
+    BoundedQueue<std::unique_ptr<PreparedBatch>> ready, spare;
+    std::vector<std::thread> producers;
+    std::atomic<int> running;
+    std::atomic<bool> stopping{false};
+    bool finished = false;
+
+    std::uint64_t batches = 0, depth_sum = 0;
+    std::uint64_t consumer_stall_ns = 0;
+    std::atomic<std::uint64_t> producer_stall_ns{0};
+
+    bool claim(std::vector<std::uint32_t> &indices, int &batch_epoch);
+    void produce(int thread);
+    bool push(std::unique_ptr<PreparedBatch> &batch);
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+/**
+ * Bounded multi-producer multi-consumer queue without locks (Vyukov's ring buffer). Every cell
+ * carries a sequence number that tells producers and consumers whose turn it is, so a push or pop
+ * is one CAS on the shared index plus one release store on the cell. Capacity is rounded up to a
+ * power of two. try_push/try_pop never block; callers decide how to wait.
+ */
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(std::size_t capacity)
+            : mask(std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1), cells(new Cell[mask + 1]) {
+        for (std::size_t i = 0; i <= mask; i++)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    // Moves from v only on success
+    bool try_push(T &v) {
+        std::size_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &c = cells[pos & mask];
+            const std::size_t seq = c.seq.load(std::memory_order_acquire);
+            const auto diff = std::ptrdiff_t(seq) - std::ptrdiff_t(pos);
+
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.value = std::move(v);
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T &out) {
+        std::size_t pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &c = cells[pos & mask];
+            const std::size_t seq = c.seq.load(std::memory_order_acquire);
+            const auto diff = std::ptrdiff_t(seq) - std::ptrdiff_t(pos + 1);
+
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    out = std::move(c.value);
+                    c.seq.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // empty
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Number of queued elements; only a snapshot while other threads are pushing or popping
+    [[nodiscard]] std::size_t size_approx() const {
+        const std::size_t t = tail.load(std::memory_order_relaxed), h = head.load(std::memory_order_relaxed);
+        return t > h ? t - h : 0;
+    }
+
+    [[nodiscard]] std::size_t capacity() const { return mask + 1; }
+
+private:
+    struct Cell {
+        std::atomic<std::size_t> seq;
+        T value{};
+    };
+
+    const std::size_t mask;
+    std::unique_ptr<Cell[]> cells;
+
+    alignas(64) std::atomic<std::size_t> tail{0};
+    alignas(64) std::atomic<std::size_t> head{0};
+};
@@ -0,0 +1,134 @@
+#include "eval_cache.hpp"
+
+#include "atomic_file.hpp"
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+namespace {
+constexpr char CACHE_MAGIC[8] = {'N', 'N', 'S', 'C', 'E', 'V', 'C', '\0'};
+constexpr std::uint32_t CACHE_VERSION = 1;
+
+// Rehash once the table is this full; probe chains stay short up to about here
+constexpr double MAX_LOAD = 0.75;
+
+struct CacheHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t entry_bytes;
+    std::uint64_t tag;
+    std::uint64_t buckets;
+    std::uint64_t count;
+};
+
+std::uint16_t to_unit16(double p) {
+    return std::uint16_t(std::lround(std::clamp(p, 0.0, 1.0) * 65535.0));
+}
+}
+
+void EvalCache::reserve(std::size_t n) {
+    const auto want = std::size_t(double(n) / (MAX_LOAD * BUCKET_ENTRIES)) + 1;
+    if (want > buckets.size())
+        rehash(std::bit_ceil(want));
+}
+
+void EvalCache::rehash(std::size_t num_buckets) {
+    std::vector<Bucket> old(num_buckets, Bucket{});
+    old.swap(buckets);
+    mask = num_buckets - 1;
+
+    for (const Bucket &b: old)
+        for (const Entry &e: b.entries)
+            if (e.key)
+                *slot(e.key) = e;
+}
+
+EvalCache::Entry *EvalCache::slot(std::uint64_t key) {
+    // Zobrist keys are uniform, so their low bits pick the bucket as is
+    for (std::size_t i = key & mask;; i = (i + 1) & mask)
+        for (Entry &e: buckets[i].entries)
+            if (e.key == key || e.key == 0)
+                return &e;
+}
+
+const EvalCache::Entry *EvalCache::find(Key key) const {
+    if (buckets.empty()) return nullptr;
+
+    const std::uint64_t k = slot_key(key);
+    for (std::size_t i = k & mask;; i = (i + 1) & mask) {
+        for (const Entry &e: buckets[i].entries) {
+            if (e.key == k) return &e;
+            if (e.key == 0) return nullptr; // entries are never removed, so the chain ends here
+        }
+    }
+}
+
+void EvalCache::insert(Key key, const StockfishEval &ev) {
+    if (double(count + 1) > MAX_LOAD * double(buckets.size() * BUCKET_ENTRIES))
+        rehash(std::max<std::size_t>(buckets.size() * 2, 1024));
+
+    const std::uint64_t k = slot_key(key);
+    Entry *e = slot(k);
+    if (e->key == 0) count++;
+
+    *e = Entry{k, to_unit16(ev.win), to_unit16(ev.loss), std::int16_t(std::clamp<int>(ev.eval, INT16_MIN, INT16_MAX)),
+               std::uint16_t(ev.depth)};
+}
+
+bool EvalCache::probe(Key key, StockfishEval &ev) const {
+    const Entry *e = find(key);
+    if (!e) return false;
+
+    ev.win = e->win / 65535.0;
+    ev.loss = e->loss / 65535.0;
+    ev.eval = Value(e->eval);
+    ev.depth = e->depth;
+    return true;
+}
+
+void EvalCache::clear() {
+    std::fill(buckets.begin(), buckets.end(), Bucket{});
+    count = 0;
+}
+
+bool EvalCache::save(const std::string &file, std::uint64_t tag) const {
+    CacheHeader h{};
+    std::memcpy(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    h.version = CACHE_VERSION;
+    h.entry_bytes = sizeof(Entry);
+    h.tag = tag;
+    h.buckets = buckets.size();
+    h.count = count;
+
+    return write_atomically(file, &h, sizeof(h), buckets.data(), memory_bytes());
+}
+
+bool EvalCache::load(const std::string &file, std::uint64_t tag) {
+    MappedFile map{file};
+    if (map.size() < sizeof(CacheHeader))
+        return false;
+
+    CacheHeader h{};
+    std::memcpy(&h, map.data(), sizeof(h));
+    if (std::memcmp(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || h.version != CACHE_VERSION ||
+        h.entry_bytes != sizeof(Entry) || h.tag != tag || !std::has_single_bit(h.buckets) ||
+        map.size() != sizeof(CacheHeader) + h.buckets * sizeof(Bucket))
+        return false;
+
+    buckets.resize(h.buckets);
+    std::memcpy(buckets.data(), map.data() + sizeof(CacheHeader), memory_bytes());
+    mask = buckets.size() - 1;
+    count = h.count;
+    return true;
+}
+
+Key fen_key(const std::string &fen) {
+    thread_local Position pos;
+    thread_local StateInfo st;
+    pos.set(fen, false, &st, nullptr);
+    return label_key(pos);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "trainer.hpp"
+
+/**
+ * Labels keyed by label_key(), for "have we labeled this already" checks without building a
+ * FEN. Open addressing over 64-byte buckets of four 16-byte entries: a lookup reads one cache line
+ * in the common case and probes the following buckets when one is full. The full 64-bit key is
+ * stored and compared, so a hit is a hit. Win and loss are kept to 1/65535, which is finer than
+ * any label is accurate; Dataset::gen keeps the exact values for training.
+ *
+ * Key 0 marks an empty slot, so a position whose key is 0 is stored under key 1.
+ */
+class EvalCache {
+public:
+    struct Entry {
+        std::uint64_t key;
+        std::uint16_t win, loss;
+        std::int16_t eval;
+        std::uint16_t depth;
+    };
+
+    static constexpr int BUCKET_ENTRIES = 4;
+
+    struct alignas(64) Bucket {
+        Entry entries[BUCKET_ENTRIES];
+    };
+
+    explicit EvalCache(std::size_t capacity = 0) { reserve(capacity); }
+
+    // Make room for n entries without rehashing
+    void reserve(std::size_t n);
+
+    // Insert or overwrite
+    void insert(Key key, const StockfishEval &ev);
+
+    [[nodiscard]] bool contains(Key key) const { return find(key) != nullptr; }
+
+    // Label of key, if present
+    [[nodiscard]] bool probe(Key key, StockfishEval &ev) const;
+
+    [[nodiscard]] std::size_t size() const { return count; }
+    [[nodiscard]] std::size_t memory_bytes() const { return buckets.size() * sizeof(Bucket); }
+
+    void clear();
+
+    // Persist the table; tag identifies the data it was built from (e.g. the journal length) for load()
+    bool save(const std::string &file, std::uint64_t tag) const;
+
+    // Replace the table with a saved one; false if missing, corrupt or saved with another tag
+    bool load(const std::string &file, std::uint64_t tag);
+
+private:
+    std::vector<Bucket> buckets;
+    std::size_t mask = 0; // buckets.size() - 1
+    std::size_t count = 0;
+
+    static std::uint64_t slot_key(Key key) { return key ? key : 1; }
+
+    [[nodiscard]] const Entry *find(Key key) const;
+    void rehash(std::size_t num_buckets);
+    Entry *slot(std::uint64_t key);
+};
+
+/**
+ * Key labels are stored and looked up under: the Zobrist key without the bucket of the rule50
+ * clock that Position::key() mixes in from 14 plies on. Labels are saved by clean_fen(), which
+ * drops the clock, so this is the only key a live position and its reloaded FEN agree on.
+ */
+inline Key label_key(const Position &pos) { return pos.state()->key; }
+
+// label_key() of the position described by fen
+Key fen_key(const std::string &fen);
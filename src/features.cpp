@@ -0,0 +1,28 @@
+#include "features.hpp"
+#include "telemetry.hpp"
+
+void encode_features(const Position &pos, BoardFeatures &out) {
+    telemetry::ScopedPhase timer{telemetry::Phase::ENCODE};
+    const Color stm = pos.side_to_move();
+    out.count = 0;
+
+    for (Color col : {stm, ~stm}) {
+        for (PieceType pt: {PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING}) {
+            Bitboard bb = pos.pieces(col, pt);
+            while (bb)
+                out.idx[out.count++] = piece_feature(stm, col, pt, pop_lsb(bb));
+        }
+
+        if (pos.castling_rights(col) & QUEEN_SIDE)
+            out.idx[out.count++] = castling_feature(stm, col, false);
+        if (pos.castling_rights(col) & KING_SIDE)
+            out.idx[out.count++] = castling_feature(stm, col, true);
+    }
+
+    if (pos.ep_square() != SQ_NONE)
+        out.idx[out.count++] = ep_feature(pos.ep_square());
+
+    out.dense[0] = pos.rule50_count() / 50.0;
+
+    assert(out.count <= MAX_ACTIVE_FEATURES);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "position.h"
+
+#include "nn_linalg.hpp"
+
+using namespace Stockfish;
+
+
+/**
+ * Number of input layers:
+ * 64 boardsize * 6 piece types * 2 sides
+ *      PLUS
+ * 64 possible en passant squares
+ *      PLUS
+ * 4 castling rights
+ *      PLUS
+ * 1 halfmove clock percentage (scales from 0 to 1, hits 1 at 50 halfmoves)
+ *
+ * Pieces and castling rights are grouped by side, side to move first. Everything but the
+ * halfmove clock is one-hot, so positions are stored as a list of active indices.
+ */
+constexpr auto INP_SIZE = 64*6*2 + 64 + 4 + 1;
+
+constexpr int SIDE_FEATURES = 64*6 + 2; // piece squares followed by queen/king side castling
+constexpr int EP_FEATURES_BEGIN = 2 * SIDE_FEATURES;
+constexpr int RULE50_FEATURE = EP_FEATURES_BEGIN + 64;
+static_assert(RULE50_FEATURE == INP_SIZE - 1);
+
+constexpr int MAX_ACTIVE_FEATURES = 32 + 4 + 1; // pieces, castling rights, en passant square
+
+using BoardFeatures = SparseInput<INP_SIZE, MAX_ACTIVE_FEATURES, 1>;
+
+// Index of a piece of colour c on s, seen from the perspective of the side to move stm
+inline constexpr int piece_feature(Color stm, Color c, PieceType pt, Square s) {
+    return (c == stm ? 0 : SIDE_FEATURES) + (pt - PAWN) * 64 + s;
+}
+
+inline constexpr int castling_feature(Color stm, Color c, bool king_side) {
+    return (c == stm ? 0 : SIDE_FEATURES) + 64*6 + king_side;
+}
+
+inline constexpr int ep_feature(Square s) {
+    return EP_FEATURES_BEGIN + s;
+}
+
+void encode_features(const Position &pos, BoardFeatures &out);
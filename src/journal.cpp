@@ -0,0 +1,170 @@
+#include "journal.hpp"
+
+#include "atomic_file.hpp"
+#include "mapped_file.hpp"
+#include "netfile.hpp"
+#include "telemetry.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+constexpr std::size_t RECORD_PREFIX_BYTES = 8;
+constexpr std::size_t MIN_PAYLOAD_BYTES = 2 + 8 + 8 + 4;
+
+template <typename T>
+void put(std::string &out, const T &v) {
+    out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+template <typename T>
+T get(const char *p) {
+    T v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+std::uint32_t payload_checksum(const char *p, std::size_t n) {
+    return std::uint32_t(net_checksum(reinterpret_cast<const std::byte *>(p), n));
+}
+}
+
+std::string journal_header() {
+    std::string h(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    put(h, JOURNAL_VERSION);
+    put(h, std::uint32_t(0));
+    return h;
+}
+
+void encode_journal_record(std::string &out, std::string_view fen, const StockfishEval &ev) {
+    std::string payload;
+    put(payload, std::uint16_t(fen.size()));
+    payload.append(fen);
+    put(payload, double(ev.win));
+    put(payload, double(ev.loss));
+    put(payload, std::int32_t(ev.eval));
+    put(payload, std::uint16_t(ev.depth));
+
+    put(out, std::uint32_t(payload.size()));
+    put(out, payload_checksum(payload.data(), payload.size()));
+    out.append(payload);
+}
+
+JournalScan scan_journal(std::string_view data, const std::function<void(std::string_view, const StockfishEval &)> &cb) {
+    JournalScan res{};
+    if (data.size() < JOURNAL_HEADER_BYTES || std::memcmp(data.data(), JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0)
+        return res;
+    if (get<std::uint32_t>(data.data() + sizeof(JOURNAL_MAGIC)) != JOURNAL_VERSION) {
+        std::cerr << "Unsupported journal version\n";
+        return res;
+    }
+
+    res.is_journal = true;
+    std::size_t pos = JOURNAL_HEADER_BYTES;
+    while (data.size() - pos >= RECORD_PREFIX_BYTES) {
+        const auto len = get<std::uint32_t>(data.data() + pos);
+        const auto sum = get<std::uint32_t>(data.data() + pos + 4);
+        const char *p = data.data() + pos + RECORD_PREFIX_BYTES;
+
+        if (len < MIN_PAYLOAD_BYTES || len > data.size() - pos - RECORD_PREFIX_BYTES || payload_checksum(p, len) != sum)
+            break;
+
+        const auto fen_len = get<std::uint16_t>(p);
+        if (MIN_PAYLOAD_BYTES + fen_len > len)
+            break;
+
+        const char *f = p + 2 + fen_len;
+        StockfishEval ev{};
+        ev.win = get<double>(f);
+        ev.loss = get<double>(f + 8);
+        ev.eval = Value(get<std::int32_t>(f + 16));
+        if (MIN_PAYLOAD_BYTES + fen_len + 2 <= len)
+            ev.depth = get<std::uint16_t>(f + 20);
+        cb(std::string_view(p + 2, fen_len), ev);
+
+        pos += RECORD_PREFIX_BYTES + len;
+        res.records++;
+    }
+
+    res.valid_bytes = pos;
+    return res;
+}
+
+LabelJournal::~LabelJournal() {
+    if (fd >= 0) {
+        flush();
+        ::close(fd);
+    }
+}
+
+bool LabelJournal::open(const std::string &path, std::uint64_t valid_bytes) {
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        std::cerr << "Cannot open " << path << ": " << std::strerror(errno) << '\n';
+        return false;
+    }
+
+    const off_t size = ::lseek(fd, 0, SEEK_END);
+    if (size == 0) {
+        const std::string h = journal_header();
+        if (write_all(fd, h.data(), h.size()))
+            return true;
+    } else if (valid_bytes >= JOURNAL_HEADER_BYTES) {
+        if (std::uint64_t(size) == valid_bytes)
+            return true;
+
+        std::cerr << path << ": dropping " << size - valid_bytes << " bytes of a torn record\n";
+        if (::ftruncate(fd, off_t(valid_bytes)) == 0)
+            return true;
+    } else {
+        std::cerr << path << " is not a label journal\n";
+    }
+
+    ::close(fd);
+    fd = -1;
+    return false;
+}
+
+void LabelJournal::append(std::string_view fen, const StockfishEval &ev) {
+    encode_journal_record(buffer, fen, ev);
+}
+
+bool LabelJournal::flush() {
+    if (fd < 0) return false;
+    if (buffer.empty()) return true;
+
+    telemetry::ScopedPhase timer{telemetry::Phase::IO};
+    const bool ok = write_all(fd, buffer.data(), buffer.size()) && ::fdatasync(fd) == 0;
+    if (!ok)
+        std::cerr << "Journal write failed: " << std::strerror(errno) << '\n';
+    buffer.clear();
+    return ok;
+}
+
+std::size_t compact_journal(const std::string &path) {
+    std::unordered_map<std::string, StockfishEval> latest;
+    JournalScan scan{};
+    {
+        MappedFile map{path};
+        map.advise_sequential();
+        scan = scan_journal(map.view(), [&](std::string_view fen, const StockfishEval &ev) {
+            latest[std::string(fen)] = ev;
+        });
+    }
+
+    if (!scan.is_journal) {
+        std::cerr << path << " is not a label journal\n";
+        return 0;
+    }
+
+    if (!write_journal(path, latest))
+        return 0;
+
+    std::cout << "Compacted " << path << ": " << scan.records << " records -> " << latest.size() << '\n';
+    return latest.size();
+}
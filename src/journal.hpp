@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+#include "atomic_file.hpp"
+#include "trainer.hpp"
+
+/**
+ * Append-only journal of labeled positions (version 1):
+ *
+ * [ magic, version ][ record ]*
+ * record = [ u32 payload bytes ][ u32 payload checksum ][ payload ]
+ * payload = [ u16 fen length ][ fen ][ f64 win ][ f64 loss ][ i32 eval ][ u16 search depth ]
+ *
+ * New labels are appended, so a flush costs only the new records, and a crash can at worst tear
+ * the last record, which readers detect by its length or checksum and drop. Readers ignore
+ * payload bytes past the fields they know, so fields can be added at the end of the payload
+ * without a version bump. The same FEN may appear more than once; the last record wins, and
+ * compact_journal() rewrites the file with one record per FEN.
+ */
+
+constexpr char JOURNAL_MAGIC[8] = {'N', 'N', 'S', 'C', 'J', 'R', 'N', '\0'};
+constexpr std::uint32_t JOURNAL_VERSION = 1;
+constexpr std::size_t JOURNAL_HEADER_BYTES = 16;
+
+struct JournalScan {
+    bool is_journal = false;     // false if the file is missing or in another format
+    std::uint64_t valid_bytes = 0; // length of the intact prefix: header plus whole, matching records
+    std::uint64_t records = 0;
+};
+
+// Call cb for every intact record of data, in file order, stopping at the first torn or corrupt one
+JournalScan scan_journal(std::string_view data, const std::function<void(std::string_view fen, const StockfishEval &ev)> &cb);
+
+// Serialize one record, appending it to out
+void encode_journal_record(std::string &out, std::string_view fen, const StockfishEval &ev);
+
+// The bytes every journal starts with
+std::string journal_header();
+
+/**
+ * Appends records to a journal. Records are buffered until flush(), which writes them with one
+ * write() and makes them durable.
+ */
+class LabelJournal {
+public:
+    LabelJournal() = default;
+    ~LabelJournal();
+
+    LabelJournal(const LabelJournal &) = delete;
+    LabelJournal &operator=(const LabelJournal &) = delete;
+
+    /**
+     * Open path for appending, creating it if missing. valid_bytes is the intact prefix found by
+     * scan_journal(); anything after it (a torn record) is cut off. Fails on files that are not
+     * journals.
+     */
+    bool open(const std::string &path, std::uint64_t valid_bytes);
+
+    void append(std::string_view fen, const StockfishEval &ev);
+
+    bool flush();
+
+private:
+    int fd = -1;
+    std::string buffer;
+};
+
+// Rewrite path with only the last record of every FEN, atomically; returns the number of records kept
+std::size_t compact_journal(const std::string &path);
+
+// Atomically replace path with a journal holding one record per (fen, ev) entry; returns its size, 0 on failure
+template <typename Map>
+std::uint64_t write_journal(const std::string &path, const Map &entries) {
+    std::string bytes = journal_header();
+    for (const auto &[fen, ev]: entries)
+        encode_journal_record(bytes, fen, ev);
+    return write_atomically(path, nullptr, 0, bytes.data(), bytes.size()) ? bytes.size() : 0;
+}
@@ -0,0 +1,193 @@
+#include "labeler.hpp"
+
+#include "thread.h"
+#include "uci.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+extern char **environ;
+
+void configure_label_worker(int threads, int hash_mb) {
+    // Replaces the options without their on_change handlers, which need a running thread pool
+    Options["Threads"] << UCI::Option(threads, 1, 1024);
+    Options["Hash"] << UCI::Option(hash_mb, 1, 33554432);
+}
+
+int run_label_worker() {
+    FILE *out = fdopen(LABEL_RESULT_FD, "w");
+    if (!out) {
+        std::cerr << "label worker: fd " << LABEL_RESULT_FD << " is not open\n";
+        return EXIT_FAILURE;
+    }
+
+    Trainer trainer{};
+    for (std::string fen; std::getline(std::cin, fen); ) {
+        trainer.position_fen(fen);
+        const StockfishEval ev = trainer.stockfish_eval();
+
+        std::fprintf(out, "%s\t%a\t%a\t%d\t%d\n", clean_fen(trainer.pos).c_str(), ev.win, ev.loss, int(ev.eval), ev.depth);
+        std::fflush(out);
+    }
+
+    std::fclose(out);
+    return EXIT_SUCCESS;
+}
+
+LabelPool::LabelPool(int num_workers, int threads_per_worker, int hash_mb) {
+    // A worker that dies mid-write must not take the coordinator with it
+    std::signal(SIGPIPE, SIG_IGN);
+
+    workers.resize(std::max(num_workers, 1));
+    for (auto &w : workers)
+        if (!spawn(w, threads_per_worker, hash_mb))
+            std::cerr << "Could not start a label worker\n";
+}
+
+LabelPool::~LabelPool() {
+    for (auto &w : workers)
+        retire(w);
+}
+
+bool LabelPool::spawn(Worker &w, int threads, int hash_mb) {
+    int req[2], res[2];
+    if (pipe2(req, O_CLOEXEC) != 0) return false;
+    if (pipe2(res, O_CLOEXEC) != 0) {
+        close(req[0]);
+        close(req[1]);
+        return false;
+    }
+
+    // dup2 clears O_CLOEXEC on the target, so the child keeps exactly stdin and LABEL_RESULT_FD
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, req[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, res[1], LABEL_RESULT_FD);
+
+    std::string threads_arg = std::to_string(threads), hash_arg = std::to_string(hash_mb);
+    char exe[] = "/proc/self/exe";
+    std::string mode = LABEL_WORKER_ARG;
+    char *argv[] = {exe, mode.data(), threads_arg.data(), hash_arg.data(), nullptr};
+
+    const int err = posix_spawn(&w.pid, exe, &actions, nullptr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(req[0]);
+    close(res[1]);
+
+    if (err != 0) {
+        close(req[1]);
+        close(res[0]);
+        w.pid = -1;
+        return false;
+    }
+
+    w.requests = req[1];
+    w.results = res[0];
+    return true;
+}
+
+void LabelPool::retire(Worker &w) {
+    if (w.requests >= 0) close(w.requests);
+    if (w.results >= 0) close(w.results);
+    w.requests = w.results = -1;
+
+    if (w.pid > 0) waitpid(w.pid, nullptr, 0);
+    w.pid = -1;
+
+    // Hand whatever it was working on to the others
+    for (auto &fen : w.outstanding)
+        queued.push_front(std::move(fen));
+    w.outstanding.clear();
+    w.buffer.clear();
+}
+
+int LabelPool::alive() const {
+    return int(std::count_if(workers.begin(), workers.end(), [](const Worker &w) { return w.pid > 0; }));
+}
+
+bool LabelPool::submit(const Position &pos) {
+    if (!pending.insert(clean_fen(pos)).second)
+        return false;
+
+    queued.push_back(pos.fen());
+    return true;
+}
+
+bool LabelPool::hungry() const {
+    return int(queued.size()) < alive() * MAX_OUTSTANDING;
+}
+
+void LabelPool::dispatch() {
+    for (auto &w : workers) {
+        while (w.pid > 0 && int(w.outstanding.size()) < MAX_OUTSTANDING && !queued.empty()) {
+            const std::string line = queued.front() + '\n';
+            if (write(w.requests, line.data(), line.size()) != ssize_t(line.size())) {
+                std::cerr << "Label worker " << w.pid << " stopped taking positions\n";
+                retire(w);
+                break;
+            }
+
+            w.outstanding.push_back(std::move(queued.front()));
+            queued.pop_front();
+        }
+    }
+}
+
+void LabelPool::collect(const Callback &cb, int timeout_ms) {
+    dispatch();
+
+    std::vector<pollfd> fds;
+    std::vector<Worker *> owners;
+    for (auto &w : workers) {
+        if (w.pid <= 0 || w.outstanding.empty()) continue;
+        fds.push_back({w.results, POLLIN, 0});
+        owners.push_back(&w);
+    }
+    if (fds.empty() || poll(fds.data(), fds.size(), timeout_ms) <= 0)
+        return;
+
+    char chunk[4096];
+    for (std::size_t i = 0; i < fds.size(); i++) {
+        if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        Worker &w = *owners[i];
+
+        const ssize_t got = read(w.results, chunk, sizeof(chunk));
+        if (got <= 0) {
+            std::cerr << "Label worker " << w.pid << " exited\n";
+            retire(w);
+            continue;
+        }
+        w.buffer.append(chunk, got);
+
+        for (std::size_t nl; (nl = w.buffer.find('\n')) != std::string::npos; w.buffer.erase(0, nl + 1)) {
+            const std::string line = w.buffer.substr(0, nl);
+            const std::size_t t1 = line.find('\t'), t2 = line.find('\t', t1 + 1), t3 = line.find('\t', t2 + 1);
+            if (t3 == std::string::npos || w.outstanding.empty()) {
+                std::cerr << "Malformed label result: " << line << '\n';
+                continue;
+            }
+
+            StockfishEval ev{};
+            ev.win = std::strtod(line.c_str() + t1 + 1, nullptr);
+            ev.loss = std::strtod(line.c_str() + t2 + 1, nullptr);
+            ev.eval = Value(std::atoi(line.c_str() + t3 + 1));
+            if (const std::size_t t4 = line.find('\t', t3 + 1); t4 != std::string::npos)
+                ev.depth = std::atoi(line.c_str() + t4 + 1);
+
+            const std::string fen = line.substr(0, t1);
+            pending.erase(fen);
+            w.outstanding.pop_front();
+            cb(fen, ev);
+        }
+    }
+
+    dispatch();
+}
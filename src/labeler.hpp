@@ -0,0 +1,72 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "trainer.hpp"
+
+/**
+ * Parallel Stockfish labeling across processes. Stockfish's Threads pool is a global, so one
+ * process can only run one search at a time; instead the coordinator spawns copies of this
+ * executable in worker mode, each with its own small Threads/Hash, and feeds them positions.
+ *
+ * Worker protocol: one full FEN per line on stdin; one result per line on LABEL_RESULT_FD as
+ * "clean fen \t win \t loss \t eval", with win/loss in hexfloat so they round-trip exactly.
+ * stdout stays free for logging.
+ */
+
+constexpr const char *LABEL_WORKER_ARG = "--label-worker";
+constexpr int LABEL_RESULT_FD = 3;
+
+// Worker side: shrink the search before Threads.set() so the Hash default is never allocated
+void configure_label_worker(int threads, int hash_mb);
+
+// Worker side: label positions until stdin closes
+int run_label_worker();
+
+class LabelPool {
+public:
+    // Positions sent to a worker before it answers, so it never waits on the coordinator
+    constexpr static int MAX_OUTSTANDING = 2;
+
+    using Callback = std::function<void(const std::string &fen, const StockfishEval &ev)>;
+
+    LabelPool(int workers, int threads_per_worker, int hash_mb);
+    ~LabelPool();
+
+    LabelPool(const LabelPool &) = delete;
+    LabelPool &operator=(const LabelPool &) = delete;
+
+    // Queue pos for labeling; false if a position with the same clean FEN is already queued or being searched
+    bool submit(const Position &pos);
+
+    // True while there are fewer queued positions than the workers can take
+    [[nodiscard]] bool hungry() const;
+
+    // Dispatch queued positions, then wait up to timeout_ms and call cb for every result that arrived
+    void collect(const Callback &cb, int timeout_ms = 1000);
+
+    [[nodiscard]] int alive() const;
+
+private:
+    struct Worker {
+        pid_t pid = -1;
+        int requests = -1; // write end of the worker's stdin
+        int results = -1; // read end of the worker's LABEL_RESULT_FD
+        std::string buffer; // partial result line
+        std::deque<std::string> outstanding; // full FENs sent and not yet answered, oldest first
+    };
+
+    std::vector<Worker> workers;
+    std::deque<std::string> queued;
+    std::unordered_set<std::string> pending; // clean FENs queued or outstanding
+
+    bool spawn(Worker &w, int threads, int hash_mb);
+    void retire(Worker &w);
+    void dispatch();
+};
@@ -11,10 +11,17 @@
 #include "tt.h"
 #include "uci.h"
 
+#include "batch_loader.hpp"
+#include "labeler.hpp"
+#include "sampler.hpp"
+#include "shard.hpp"
+#include "telemetry.hpp"
 #include "traindata.hpp"
 #include "trainer.hpp"
+#include "quantized_net.hpp"
 #include <cfenv>
 
+#include <filesystem>
 #include <random>
 
 using namespace Stockfish;
@@ -24,18 +31,43 @@ std::mt19937_64 mt64(dev());
 
 
 
-void generate_training_data() {
+// Keep the dataset balanced: labels on the side the average already leans to are mostly dropped
+bool accept_label(const Dataset &set, const StockfishEval &ev) {
+    double failChance = ev.eval > 0 ? 80 : 10; // change of adding position anyway despite being wrong direction
+    if (ev.eval > 0)
+        failChance *= std::min(1 - std::abs(ev.eval) / 1600.0, 1.0); // prefer low positive values
+    else
+        failChance *= std::min(std::abs(ev.eval) / 1600.0, 1.0); // prefer high negative values
+
+    std::uniform_real_distribution<double> chanceIgn(0, 100);
+
+    return chanceIgn(mt64) <= failChance || std::signbit<int>(ev.eval) != std::signbit(set.accum);
+}
+
+void generate_training_data(const std::string &puzzles = DEFAULT_PUZZLE_CSV, SearchStart search_start = DEFAULT_SEARCH_START,
+                            bool harvest_children = false) {
     Dataset set;
+    if (!set.load_puzzles(puzzles)) return;
     set.load_from_bin("traindata.bin");
+    set.index_evals("traindata.keys");
     set.print();
 //    set.mm_print();
 
+    PuzzleQuery query;
+    query.all_of = {"equality"};
+    const PuzzleSelection equal = set.select_puzzles(query);
+    if (equal.empty()) return;
+
+    LabelJournal journal;
+    if (!set.open_journal(journal, "traindata.bin")) return;
+
     Trainer trainer{};
+    trainer.search_start = search_start;
 
     int counter = 0;
     auto eval = [&]() {
+        if (MoveList<LEGAL>(trainer.pos).size() == 0 || set.evals.contains(label_key(trainer.pos))) return;
         std::string cleanFen = clean_fen(trainer.pos);
-        if (MoveList<LEGAL>(trainer.pos).size() == 0 || set.gen.count(cleanFen) > 0) return;
 
 
         auto start = std::chrono::high_resolution_clock::now();
@@ -43,21 +75,13 @@ void generate_training_data() {
         auto diff = std::chrono::high_resolution_clock::now() - start;
         auto sec = std::chrono::duration_cast<std::chrono::milliseconds>(diff).count() / 1000.0;
 
-        double failChance = ev.eval > 0 ? 80 : 10; // change of adding position anyway despite being wrong direction
-        if (ev.eval > 0)
-            failChance *= std::min(1 - std::abs(ev.eval) / 1600.0, 1.0); // prefer low positive values
-        else
-            failChance *= std::min(std::abs(ev.eval) / 1600.0, 1.0); // prefer high negative values
-
-        std::uniform_real_distribution<double> chanceIgn(0, 100);
-
         NumericT avgW = set.accum_w / set.avg_divisor;
         NumericT avgL = set.accum_l / set.avg_divisor;
 
 //        NumericT dw = avgW - 0.5;
 //        NumericT dl = avgL - 0.5;
 
-        if (chanceIgn(mt64) > failChance && std::signbit<int>(ev.eval) == std::signbit(set.accum)) return;
+        if (!accept_label(set, ev)) return;
 
 //        double rejectionChance = ev.eval > 0 ? 5 : 10; // chance of rejecting a perfectly good candidate
 //        if (ev.eval > 0)
@@ -66,27 +90,56 @@ void generate_training_data() {
 //            rejectionChance *= std::clamp(1 - std::abs(ev.eval) / 3200.0, 0.0, 1.0); // prefer high negative values
 //        if (chanceIgn(mt64) < rejectionChance) return;
 
-        set.gen[cleanFen] = ev;
+        set.add(cleanFen, ev, label_key(trainer.pos));
+        journal.append(cleanFen, ev);
+        telemetry::add(telemetry::Counter::LABELS);
+
+        if (telemetry::verbose())
+            std::cout << counter << "\t" << cleanFen << '\t' << ev.eval << "\twlr " << ev.win << ' '
+                      << ev.loss << '\t' << sec << "sec" << "\t avg " << set.accum / set.avg_divisor
+                      << "\tavgwdl " << avgW << " " << avgL << std::endl;
+        counter++;
+    };
 
-        set.accum += ev.eval;
-        set.accum_w += ev.win;
-        set.accum_l += ev.loss;
-        set.avg_divisor++;
+    // Label the position and all of its children from one MultiPV search
+    auto harvest = [&]() {
+        if (MoveList<LEGAL>(trainer.pos).size() == 0 || set.evals.contains(label_key(trainer.pos))) return;
+
+        const ChildLabels labels = trainer.label_children();
+        int kept = 0;
+        auto keep = [&](const StockfishEval &ev) {
+            if (set.evals.contains(label_key(trainer.pos)) || !accept_label(set, ev)) return;
+
+            const std::string cleanFen = clean_fen(trainer.pos);
+            set.add(cleanFen, ev, label_key(trainer.pos));
+            journal.append(cleanFen, ev);
+            kept++;
+        };
+
+        keep(labels.parent);
+        StateInfo st{};
+        for (const auto &[m, ev]: labels.children) {
+            trainer.pos.do_move(m, st);
+            if (MoveList<LEGAL>(trainer.pos).size() > 0)
+                keep(ev);
+            trainer.pos.undo_move(m);
+        }
 
-        std::cout << counter++ << "\t" << cleanFen << '\t' << ev.eval << "\twlr " << ev.win << ' '
-                  << ev.loss << '\t' << sec << "sec" << "\t avg " << set.accum / set.avg_divisor
-                  << "\tavgwdl " << avgW << " " << avgL << std::endl;
+        counter += kept;
+        telemetry::add(telemetry::Counter::LABELS, kept);
+        if (telemetry::verbose())
+            std::cout << counter << "\t" << clean_fen(trainer.pos) << '\t' << labels.parent.eval << "\tkept " << kept
+                      << " of " << labels.children.size() + 1 << "\t avg " << set.accum / set.avg_divisor << std::endl;
     };
 
 
     while (true) {
-        const Puzzle *p;
-        do {
-            p = &set.dataset.at(set.dist(mt64));
-        } while (!(p->Themes.contains("equality")));
-
-        trainer.position_fen(p->FEN, p->Moves, [&]() {
-            eval();
+        const Puzzle p = set.dataset[equal.sample(mt64)];
+        trainer.position_fen(std::string(p.FEN), std::string(p.Moves), [&]() {
+            if (harvest_children)
+                harvest();
+            else
+                eval();
 //                StateInfo st{};
 //
 //                for (auto m :  MoveList<LEGAL>(trainer.pos)) {
@@ -95,55 +148,294 @@ void generate_training_data() {
 //                    trainer.pos.undo_move(m);
 //                }
         });
+        telemetry::maybe_report();
 
         if (counter > 256) {
-            std::ofstream fd("traindata.bin", std::ios::out | std::ios::binary);
-            for (const auto &v: set.gen) {
-                fd << 'N' << v.first << ',';
-                fd.write((const char *) &v.second, sizeof(StockfishEval));
-            }
-
-            fd.close();
+            journal.flush();
+            std::cout << trainer.label_timing << std::endl;
             counter = 0;
 //                break;
         }
     }
 }
 
+/**
+ * generate_training_data() spread over worker processes with their own small Threads/Hash, which
+ * gives far more labels per hour than one wide search on a many-core machine.
+ */
+void generate_training_data_parallel(int workers, int threads_per_worker = 8, int hash_mb = 256,
+                                     const std::string &puzzles = DEFAULT_PUZZLE_CSV) {
+    // The coordinator never searches
+    Options["Hash"] = std::string("1");
+
+    Dataset set;
+    if (!set.load_puzzles(puzzles)) return;
+    set.load_from_bin("traindata.bin");
+    set.index_evals("traindata.keys");
+    set.print();
+
+    PuzzleQuery query;
+    query.all_of = {"equality"};
+    const PuzzleSelection equal = set.select_puzzles(query);
+    if (equal.empty()) return;
+
+    LabelJournal journal;
+    if (!set.open_journal(journal, "traindata.bin")) return;
 
-void train_network() {
     Trainer trainer{};
-    trainer.net = std::make_unique<Network>();
-    trainer.net->load();
+    LabelPool pool{workers, threads_per_worker, hash_mb};
+
+    int counter = 0;
+    auto on_result = [&](const std::string &cleanFen, const StockfishEval &ev) {
+        const Key key = fen_key(cleanFen);
+        if (set.evals.contains(key) || !accept_label(set, ev)) return;
+
+        set.add(cleanFen, ev, key);
+        journal.append(cleanFen, ev);
+        telemetry::add(telemetry::Counter::LABELS);
+        if (telemetry::verbose())
+            std::cout << counter << "\t" << cleanFen << '\t' << ev.eval << "\twlr " << ev.win << ' ' << ev.loss
+                      << "\t avg " << set.accum / set.avg_divisor << std::endl;
+        counter++;
+    };
+
+    while (pool.alive() > 0) {
+        while (pool.hungry()) {
+            const Puzzle p = set.dataset[equal.sample(mt64)];
+            trainer.position_fen(std::string(p.FEN), std::string(p.Moves), [&]() {
+                if (MoveList<LEGAL>(trainer.pos).size() > 0 && !set.evals.contains(label_key(trainer.pos)))
+                    pool.submit(trainer.pos);
+            });
+        }
+
+        pool.collect(on_result);
+        telemetry::maybe_report();
+
+        if (counter > 256) {
+            journal.flush();
+            counter = 0;
+        }
+    }
+
+    journal.flush();
+}
+
+std::ostream &operator<<(std::ostream &os, const LoaderStats &s) {
+    return os << "loader: " << s.batches << " batches, queue depth " << s.mean_depth << '/' << s.capacity
+              << ", training waited " << s.consumer_stall_sec << "s, producers waited " << s.producer_stall_sec << 's';
+}
+
+/**
+ * Trains on every batch a BatchLoader delivers and checkpoints every save_interval samples. Each
+ * thread that gets a share of a batch has its own gradient buffers, about as large as the network
+ * itself, so batches of at least threads * MAX_BATCH keep every thread busy on full columns; the
+ * optimizer keeps up to two more copies (Adam) that are checkpointed with the weights. A checkpoint
+ * copies and writes all of them, so the default interval of 2^20 samples is thousands of steps.
+ */
+struct TrainLoop {
+    Trainer &trainer;
+    WorkerPool &pool;
+    Checkpointer checkpointer{"net2.nn"};
+    int save_interval;
+    int num = 0, since_save = 0;
+
+    TrainLoop(Trainer &t, WorkerPool &p, int save, const Optimizer &optimizer) : trainer(t), pool(p), save_interval(save) {
+        trainer.net = std::make_unique<Network>();
+        trainer.net->set_optimizer(optimizer);
+        trainer.net->load();
+        trainer.pool = &pool;
+    }
+
+    void run(BatchLoader &loader) {
+        while (auto batch = loader.next()) {
+            // Swapping hands the trainer's spent buffers back to the loader for reuse
+            trainer.batch_inputs.swap(batch->inputs);
+            trainer.batch_labels.swap(batch->labels);
+            const int epoch = batch->epoch;
+            loader.recycle(std::move(batch));
+
+            const int n = trainer.train_batch();
+            trainer.net->apply_backprop(&pool);
+            num += n;
+            since_save += n;
+            telemetry::maybe_report();
+
+            // A checkpoint the writer is too busy to take is retried after the next batch
+            if (since_save >= save_interval && trainer.net->checkpoint(checkpointer)) {
+                since_save = 0;
+                std::cout << " ================================ [ CHECKPOINT QUEUED! num = " << num
+                          << ", epoch = " << epoch << " ] ================================\n"
+                          << loader.stats() << '\n';
+            }
+        }
+
+        checkpointer.wait();
+        trainer.net->checkpoint(checkpointer);
+        checkpointer.wait();
+        telemetry::report();
+        std::cout << loader.stats() << '\n';
+    }
+};
+
+void train_network(int epochs = 1, int batch_size = 256, int save_interval = 1 << 20,
+                   int threads = int(std::thread::hardware_concurrency()), Stratify stratify = Stratify::NONE,
+                   int loader_threads = 4, const Optimizer &optimizer = Optimizer::adam()) {
+    WorkerPool pool{threads};
+    Trainer trainer{};
+    TrainLoop loop{trainer, pool, save_interval, optimizer};
 
     Dataset set;
     set.load_from_bin("traindata.bin");
-   
-
     set.print();
 
-    int num = 0; // 10240
-    while (set.gen.size() > 4) {
-        auto it = set.gen.begin();
+    const std::vector<std::pair<std::string, StockfishEval>> entries(set.gen.begin(), set.gen.end());
+
+    EpochSampler sampler{entries.size()};
+    if (stratify != Stratify::NONE) {
+        std::vector<std::uint8_t> buckets;
+        for (const auto &[fen, ev]: entries)
+            buckets.push_back(wdl_bucket(ev.win, ev.loss));
+        sampler.stratify(buckets, WDL_BUCKETS, stratify);
+    }
+
+    // FEN parsing and feature encoding happen on the loader threads, one Position each
+    std::vector<Position> positions(loader_threads);
+    std::vector<StateInfo> states(loader_threads);
+    auto decode = [&](std::uint32_t i, int thread, BoardFeatures &features, std::array<NumericT, 2> &label) {
+        const auto &[fen, ev] = entries[i];
+        positions[thread].set(fen, false, &states[thread], nullptr);
+        encode_features(positions[thread], features);
+        label = {NumericT(ev.win), NumericT(ev.loss)};
+    };
+
+    BatchLoader loader{sampler, mt64, epochs, batch_size, decode, loader_threads};
+    loop.run(loader);
+}
 
-        auto dist = std::uniform_int_distribution<std::size_t>(0, set.gen.size() - 1);
-        std::advance(it, dist(mt64));
+// Offline: keep only the latest label of every position in the journal
+void compact_training_data() {
+    compact_journal("traindata.bin");
+}
 
-        trainer.position_fen(it->first);
-        trainer.train_this_position(&set.gen);
+// Featurize every labeled position in traindata.bin into shards of at most per_shard records
+std::vector<std::string> convert_training_data(const std::string &prefix = "traindata", std::size_t per_shard = 1 << 20) {
+    Dataset set;
+    set.load_from_bin("traindata.bin");
 
-        if (num++ % 512 == 511) {
-            trainer.net->apply_backprop();
-            trainer.net->save();
-            std::cout << " ================================ [ NETWORK SAVED! num = " << num
-                      << ", left = " << set.gen.size() << " ] ================================\n";
+    Trainer trainer{};
+    std::vector<std::string> paths;
+    ShardWriter writer;
+    BoardFeatures features;
+
+    for (const auto &[fen, ev]: set.gen) {
+        if (writer.size() == per_shard || paths.empty()) {
+            if (!paths.empty() && !writer.finish()) return {};
+
+            char name[32];
+            std::snprintf(name, sizeof(name), "-%05zu.shard", paths.size());
+            paths.push_back(prefix + name);
+            if (!writer.open(paths.back())) return {};
         }
 
-        set.gen.erase(it);
+        trainer.position_fen(fen);
+        encode_features(trainer.pos, features);
+        writer.append(make_shard_record(features, ev));
     }
 
-    trainer.net->apply_backprop();
-    trainer.net->save();
+    if (!paths.empty() && !writer.finish()) return {};
+
+    std::cout << "Wrote " << set.gen.size() << " positions to " << paths.size() << " shards\n";
+    return paths;
+}
+
+// train_network() from pre-featurized shards, shuffled in blocks so each block is read sequentially.
+// Decoding a record is only a copy out of the mapping, so fewer loader_threads keep up than there.
+void train_network_shards(const std::vector<std::string> &paths, int epochs = 1, int batch_size = 256,
+                          int save_interval = 1 << 20, int threads = int(std::thread::hardware_concurrency()),
+                          Stratify stratify = Stratify::NONE, std::size_t block = 4096, int loader_threads = 2,
+                          const Optimizer &optimizer = Optimizer::adam()) {
+    std::vector<Shard> shards(paths.size());
+    std::vector<std::size_t> first{0}; // global index of the first record of every shard
+    for (std::size_t i = 0; i < paths.size(); i++) {
+        if (!shards[i].open(paths[i])) return;
+        first.push_back(first.back() + shards[i].size());
+    }
+
+    auto record = [&](std::size_t i) -> const ShardRecord & {
+        const std::size_t s = std::upper_bound(first.begin(), first.end(), i) - first.begin() - 1;
+        return shards[s][i - first[s]];
+    };
+
+    EpochSampler sampler{first.back(), block};
+    if (stratify != Stratify::NONE) {
+        std::vector<std::uint8_t> buckets(first.back());
+        for (std::size_t i = 0; i < buckets.size(); i++)
+            buckets[i] = wdl_bucket(record(i).win, record(i).loss);
+        sampler.stratify(buckets, WDL_BUCKETS, stratify);
+    }
+
+    WorkerPool pool{threads};
+    Trainer trainer{};
+    TrainLoop loop{trainer, pool, save_interval, optimizer};
+
+    auto decode = [&](std::uint32_t i, int, BoardFeatures &features, std::array<NumericT, 2> &label) {
+        unpack_shard_record(record(i), features, label);
+    };
+
+    BatchLoader loader{sampler, mt64, epochs, batch_size, decode, loader_threads};
+    loop.run(loader);
+}
+
+/**
+ * Label a position whose rule50 clock is past 14 as a labeling run does, save it, reload and index
+ * it as the next run would, and check that the label is found under the same key both times.
+ */
+bool check_label_keys(const std::string &fen = "r3k2r/ppp2ppp/2n5/3q4/3P4/2N5/PPP2PPP/R2QK2R w KQkq - 23 40") {
+    const std::string file = (std::filesystem::temp_directory_path() / "label_keys_check.bin").string();
+    const std::string keys = file + ".keys";
+
+    Trainer trainer{};
+    trainer.position_fen(fen);
+    const Key key = label_key(trainer.pos);
+    const StockfishEval label{0.25, 0.5, Value(-120), 12};
+
+    bool ok = true;
+    {
+        Dataset set;
+        set.add(clean_fen(trainer.pos), label, key);
+        ok &= set.save_to_bin(file) > 0 && set.evals.contains(key);
+    }
+
+    Dataset reloaded;
+    reloaded.load_from_bin(file);
+    reloaded.index_evals(keys);
+    StockfishEval ev{};
+    ok &= reloaded.evals.probe(key, ev) && ev.depth == label.depth && fen_key(clean_fen(trainer.pos)) == key;
+
+    std::filesystem::remove(file);
+    std::filesystem::remove(keys);
+    std::cout << "LABEL KEYS: " << (ok ? "ok" : "FAILED, saved labels are not found after a reload") << " for " << fen
+              << '\n';
+    return ok;
+}
+
+// Quantize the saved network and compare it to the float one on positions from the training data
+void check_quantized_network(std::size_t num_samples = 4096) {
+    Trainer trainer{};
+    trainer.net = std::make_unique<Network>();
+    if (!trainer.net->load()) return;
+
+    Dataset set;
+    set.load_from_bin("traindata.bin");
+
+    std::vector<std::string> fens;
+    for (const auto &entry: set.gen) {
+        if (fens.size() == num_samples) break;
+        fens.push_back(entry.first);
+    }
+
+    const QuantizedNetwork q{*trainer.net};
+    check_quantization(trainer, q, fens);
 }
 
 int main(int argc, char* argv[]) {
@@ -155,6 +447,12 @@ int main(int argc, char* argv[]) {
 
     CommandLine::init(argc, argv);
     UCI::init(Options);
+
+    // Spawned by LabelPool: argv = exe, LABEL_WORKER_ARG, threads, hash
+    const bool label_worker = argc >= 4 && std::string(argv[1]) == LABEL_WORKER_ARG;
+    if (label_worker)
+        configure_label_worker(std::atoi(argv[2]), std::atoi(argv[3]));
+
     Tune::init();
     PSQT::init();
     Bitboards::init();
@@ -165,7 +463,21 @@ int main(int argc, char* argv[]) {
     Search::clear(); // After threads are up
     Eval::NNUE::init();
 
+    // A stats line every 10s; VERBOSE brings back the per-sample lines, a path adds JSON lines
+    telemetry::configure(telemetry::Verbosity::SUMMARY, 10, "");
+
+    if (label_worker) {
+        const int ret = run_label_worker();
+        Threads.set(0);
+        return ret;
+    }
+
 //    generate_training_data();
+//    generate_training_data_parallel(8);
+//    compact_training_data();
+//    check_quantized_network();
+//    check_label_keys();
+//    train_network_shards(convert_training_data(), 4);
     train_network();
 
 //    UCI::loop(argc, argv);
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Read-only, private memory mapping of a whole file. Empty files and failures leave it closed.
+ */
+class MappedFile {
+public:
+    MappedFile() = default;
+
+    explicit MappedFile(const std::string &path) {
+        open(path);
+    }
+
+    MappedFile(MappedFile &&other) noexcept
+            : ptr(std::exchange(other.ptr, nullptr)), len(std::exchange(other.len, 0)) {}
+
+    MappedFile &operator=(MappedFile &&other) noexcept {
+        if (this != &other) {
+            close();
+            ptr = std::exchange(other.ptr, nullptr);
+            len = std::exchange(other.len, 0);
+        }
+        return *this;
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    bool open(const std::string &path) {
+        close();
+
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st{};
+        if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                ptr = static_cast<const std::byte *>(p);
+                len = st.st_size;
+            }
+        }
+
+        ::close(fd);
+        return ptr != nullptr;
+    }
+
+    void close() {
+        if (ptr)
+            ::munmap(const_cast<std::byte *>(ptr), len);
+        ptr = nullptr;
+        len = 0;
+    }
+
+    // Tell the kernel the mapping will be read front to back
+    void advise_sequential() const {
+        if (ptr)
+            ::madvise(const_cast<std::byte *>(ptr), len, MADV_SEQUENTIAL);
+    }
+
+    [[nodiscard]] bool is_open() const { return ptr != nullptr; }
+    [[nodiscard]] const std::byte *data() const { return ptr; }
+    [[nodiscard]] std::size_t size() const { return len; }
+
+    [[nodiscard]] std::string_view view() const {
+        return {reinterpret_cast<const char *>(ptr), len};
+    }
+
+private:
+    const std::byte *ptr = nullptr;
+    std::size_t len = 0;
+};
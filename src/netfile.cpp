@@ -0,0 +1,189 @@
+#include "netfile.hpp"
+#include "atomic_file.hpp"
+#include "telemetry.hpp"
+
+#include <cstring>
+#include <iostream>
+
+std::uint64_t net_checksum(const std::byte *data, std::size_t bytes) {
+    constexpr std::uint64_t prime = 0x100000001b3ULL;
+    std::uint64_t lane[4] = {0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL, 0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL};
+
+    std::size_t i = 0;
+    for (; i + 32 <= bytes; i += 32) {
+        for (int l = 0; l < 4; l++) {
+            std::uint64_t w;
+            std::memcpy(&w, data + i + 8 * l, 8);
+            lane[l] = (lane[l] ^ w) * prime;
+        }
+    }
+
+    std::uint64_t h = lane[0] ^ (lane[1] << 1) ^ (lane[2] << 2) ^ (lane[3] << 3);
+    for (; i < bytes; i++)
+        h = (h ^ std::uint64_t(data[i])) * prime;
+
+    return h ^ bytes;
+}
+
+bool same_shape(const NetFileHeader &a, const NetFileHeader &b) {
+    if (std::memcmp(a.magic, b.magic, sizeof(a.magic)) != 0 || a.version != b.version ||
+        a.dtype != b.dtype || a.num_layers != b.num_layers || a.payload_bytes != b.payload_bytes)
+        return false;
+
+    for (std::uint32_t l = 0; l < a.num_layers; l++)
+        if (a.layers[l].inputs != b.layers[l].inputs || a.layers[l].outputs != b.layers[l].outputs ||
+            a.layers[l].layout != b.layers[l].layout)
+            return false;
+
+    return true;
+}
+
+bool NetFile::open(const std::string &path, bool verify_checksum) {
+    if (!map.open(path)) {
+        std::cerr << "Cannot map " << path << '\n';
+        return false;
+    }
+
+    if (map.size() < NET_FILE_PAYLOAD_OFFSET || std::memcmp(header().magic, NET_FILE_MAGIC, sizeof(NET_FILE_MAGIC)) != 0) {
+        std::cerr << path << " is not a network file\n";
+        map.close();
+        return false;
+    }
+
+    const NetFileHeader &h = header();
+    if (h.version != NET_FILE_VERSION || h.num_layers > NET_FILE_MAX_LAYERS ||
+        h.payload_offset < sizeof(NetFileHeader) || h.payload_offset + h.payload_bytes > map.size()) {
+        std::cerr << path << ": unsupported version or truncated file\n";
+        map.close();
+        return false;
+    }
+
+    if (verify_checksum && net_checksum(payload(), h.payload_bytes) != h.checksum) {
+        std::cerr << path << ": checksum mismatch\n";
+        map.close();
+        return false;
+    }
+
+    return true;
+}
+
+namespace {
+// Header zero padded to a page, then the payload
+bool write_paged(const std::string &path, const void *header, std::size_t header_bytes,
+                 const std::byte *payload, std::size_t bytes) {
+    std::byte page[NET_FILE_PAYLOAD_OFFSET]{};
+    std::memcpy(page, header, header_bytes);
+    return write_atomically(path, page, sizeof(page), payload, bytes);
+}
+}
+
+bool write_net_file(const std::string &path, NetFileHeader header, const std::byte *payload, std::size_t bytes,
+                    std::uint64_t *checksum) {
+    header.payload_offset = NET_FILE_PAYLOAD_OFFSET;
+    header.payload_bytes = bytes;
+    header.checksum = net_checksum(payload, bytes);
+    if (checksum) *checksum = header.checksum;
+
+    return write_paged(path, &header, sizeof(header), payload, bytes);
+}
+
+bool write_optim_file(const std::string &path, OptimFileHeader header, const std::byte *payload, std::size_t bytes) {
+    std::memcpy(header.magic, OPTIM_FILE_MAGIC, sizeof(header.magic));
+    header.version = OPTIM_FILE_VERSION;
+    header.payload_offset = NET_FILE_PAYLOAD_OFFSET;
+    header.checksum = net_checksum(payload, bytes);
+
+    return write_paged(path, &header, sizeof(header), payload, bytes);
+}
+
+bool read_optim_file(const std::string &path, OptimFileHeader &header, std::vector<std::byte> &payload) {
+    MappedFile map;
+    if (!map.open(path)) {
+        std::cerr << "Cannot map " << path << '\n';
+        return false;
+    }
+
+    if (map.size() < NET_FILE_PAYLOAD_OFFSET) {
+        std::cerr << path << " is not an optimizer state file\n";
+        return false;
+    }
+
+    std::memcpy(&header, map.data(), sizeof(header));
+    const std::uint64_t bytes = header.slots * header.slot_bytes;
+    if (std::memcmp(header.magic, OPTIM_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != OPTIM_FILE_VERSION ||
+        header.payload_offset < sizeof(header) || header.payload_offset + bytes > map.size()) {
+        std::cerr << path << ": not an optimizer state file, unsupported version or truncated\n";
+        return false;
+    }
+
+    const std::byte *data = map.data() + header.payload_offset;
+    if (net_checksum(data, bytes) != header.checksum) {
+        std::cerr << path << ": checksum mismatch\n";
+        return false;
+    }
+
+    payload.assign(data, data + bytes);
+    return true;
+}
+
+Checkpointer::Checkpointer(std::string file) : path(std::move(file)), worker([this] { run(); }) {}
+
+Checkpointer::~Checkpointer() {
+    {
+        std::unique_lock<std::mutex> lg(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    worker.join();
+}
+
+bool Checkpointer::request(const NetFileHeader &header, const std::byte *payload, std::size_t bytes,
+                           const OptimFileHeader *optim, const std::byte *optim_payload) {
+    {
+        std::unique_lock<std::mutex> lg(mtx);
+        if (has_pending || writing)
+            return false;
+
+        pending.assign(payload, payload + bytes);
+        pending_header = header;
+
+        pending_optim = optim ? *optim : OptimFileHeader{};
+        if (optim) pending_moments.assign(optim_payload, optim_payload + optim->slots * optim->slot_bytes);
+        else pending_moments.clear();
+        has_pending = true;
+    }
+    cv.notify_all();
+    return true;
+}
+
+void Checkpointer::wait() {
+    std::unique_lock<std::mutex> lg(mtx);
+    cv.wait(lg, [this] { return !has_pending && !writing; });
+}
+
+void Checkpointer::run() {
+    std::unique_lock<std::mutex> lg(mtx);
+    while (true) {
+        cv.wait(lg, [this] { return has_pending || stopping; });
+        if (!has_pending)
+            return; // stopping with nothing left to write
+
+        std::swap(pending, in_flight);
+        std::swap(pending_moments, in_flight_moments);
+        NetFileHeader header = pending_header;
+        OptimFileHeader optim = pending_optim;
+        has_pending = false;
+        writing = true;
+
+        lg.unlock();
+        {
+            telemetry::ScopedPhase timer{telemetry::Phase::CHECKPOINT};
+            if (write_net_file(path, header, in_flight.data(), in_flight.size(), &optim.param_checksum) && optim.slots)
+                write_optim_file(optim_file_path(path), optim, in_flight_moments.data(), in_flight_moments.size());
+        }
+        lg.lock();
+
+        writing = false;
+        cv.notify_all();
+    }
+}
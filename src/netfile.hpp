@@ -0,0 +1,162 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mapped_file.hpp"
+
+/**
+ * Network file format (version 1):
+ *
+ * [ NetFileHeader, zero padded to NET_FILE_PAYLOAD_OFFSET ][ payload ]
+ *
+ * The payload is the network's parameter arena section byte for byte, so Network::load() fills the
+ * section with a single copy out of the mapping; the page-sized header keeps the payload aligned.
+ * Layer shapes, the element type and a checksum of the payload make files self-describing, and
+ * a shape or size mismatch is caught before anything is copied.
+ */
+
+constexpr char NET_FILE_MAGIC[8] = {'N', 'N', 'S', 'C', 'N', 'E', 'T', '\0'};
+constexpr std::uint32_t NET_FILE_VERSION = 1;
+constexpr std::size_t NET_FILE_PAYLOAD_OFFSET = 4096;
+constexpr int NET_FILE_MAX_LAYERS = 16;
+
+enum class NetDType : std::uint32_t {
+    F32 = 0,
+};
+
+enum class NetLayout : std::uint32_t {
+    OUTPUT_MAJOR = 0, // weights[out][in], as Layer stores them
+    INPUT_MAJOR = 1,  // weights[in][out], as SparseLayer stores them
+};
+
+struct NetFileLayer {
+    std::uint32_t inputs, outputs;
+    NetLayout layout;
+    std::uint32_t reserved;
+};
+
+struct NetFileHeader {
+    char magic[8];
+    std::uint32_t version;
+    NetDType dtype;
+    std::uint32_t num_layers;
+    std::uint32_t reserved;
+    std::uint64_t payload_offset;
+    std::uint64_t payload_bytes;
+    std::uint64_t checksum;
+    NetFileLayer layers[NET_FILE_MAX_LAYERS];
+};
+
+static_assert(sizeof(NetFileHeader) <= NET_FILE_PAYLOAD_OFFSET);
+
+// 64-bit hash of a buffer; four independent lanes so it runs at memory speed
+std::uint64_t net_checksum(const std::byte *data, std::size_t bytes);
+
+// Same magic, version, dtype and layer shapes
+bool same_shape(const NetFileHeader &a, const NetFileHeader &b);
+
+/**
+ * Optimizer state file (version 1), written next to a network file as optim_file_path(path):
+ *
+ * [ OptimFileHeader, zero padded to NET_FILE_PAYLOAD_OFFSET ][ slot 0 ][ slot 1 ] ...
+ *
+ * Every slot is laid out like the network's payload. param_checksum is the checksum of the network
+ * file it was saved with, so moments are never paired with weights they do not belong to.
+ */
+
+constexpr char OPTIM_FILE_MAGIC[8] = {'N', 'N', 'S', 'C', 'O', 'P', 'T', '\0'};
+constexpr std::uint32_t OPTIM_FILE_VERSION = 1;
+
+struct OptimFileHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t kind; // OptimizerKind
+    std::uint64_t steps;
+    std::uint64_t slots;
+    std::uint64_t slot_bytes;
+    std::uint64_t param_checksum;
+    std::uint64_t payload_offset;
+    std::uint64_t checksum;
+};
+
+static_assert(sizeof(OptimFileHeader) <= NET_FILE_PAYLOAD_OFFSET);
+
+inline std::string optim_file_path(const std::string &net_path) { return net_path + ".optim"; }
+
+/**
+ * Read-only mapping of a network file, validated on open.
+ */
+class NetFile {
+public:
+    // Maps and validates path; on failure, explains why on std::cerr and returns false
+    bool open(const std::string &path, bool verify_checksum = true);
+
+    [[nodiscard]] const NetFileHeader &header() const { return *reinterpret_cast<const NetFileHeader *>(map.data()); }
+    [[nodiscard]] const std::byte *payload() const { return map.data() + header().payload_offset; }
+
+private:
+    MappedFile map;
+};
+
+/**
+ * Write header + payload to path + ".tmp", fsync it and rename it over path, so a crash at any
+ * point leaves either the old or the new file, never a torn one. Fills in the checksum, which is
+ * also stored to *checksum if given.
+ */
+bool write_net_file(const std::string &path, NetFileHeader header, const std::byte *payload, std::size_t bytes,
+                    std::uint64_t *checksum = nullptr);
+
+// The same for an optimizer state file; fills in magic, version, offset and checksum
+bool write_optim_file(const std::string &path, OptimFileHeader header, const std::byte *payload, std::size_t bytes);
+
+// Validated copy of an optimizer state file's header and payload; explains failures on std::cerr
+bool read_optim_file(const std::string &path, OptimFileHeader &header, std::vector<std::byte> &payload);
+
+/**
+ * Writes network checkpoints from a background thread.
+ *
+ * request() copies the parameters (and the optimizer state, if any) into a staging buffer, which
+ * is the only work done on the caller's thread, and returns. While an older checkpoint is still
+ * waiting or being written, request() copies nothing and returns false: with Adam a copy is three
+ * times the network, and training should not pay for checkpoints the disk cannot keep up with. The
+ * staging and writing buffers swap, so steady-state checkpoints allocate nothing. The optimizer
+ * state goes to optim_file_path(path) once the network file is written.
+ */
+class Checkpointer {
+public:
+    explicit Checkpointer(std::string path);
+    ~Checkpointer();
+
+    Checkpointer(const Checkpointer &) = delete;
+    Checkpointer &operator=(const Checkpointer &) = delete;
+
+    // False if the writer was busy and nothing was queued
+    bool request(const NetFileHeader &header, const std::byte *payload, std::size_t bytes,
+                 const OptimFileHeader *optim = nullptr, const std::byte *optim_payload = nullptr);
+
+    // Block until everything requested so far is on disk
+    void wait();
+
+private:
+    std::string path;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool has_pending = false, writing = false, stopping = false;
+    NetFileHeader pending_header{};
+    std::vector<std::byte> pending, in_flight;
+
+    // Optimizer state of the pending checkpoint; slots == 0 if there is none
+    OptimFileHeader pending_optim{};
+    std::vector<std::byte> pending_moments, in_flight_moments;
+
+    std::thread worker;
+
+    void run();
+};
@@ -0,0 +1,310 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "nn_half.hpp"
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define NN_GEMM_AVX2
+#endif
+
+/**
+ * Single precision GEMM used behind Matrix::operator*.
+ *
+ * Layout follows the usual Goto/BLIS scheme: B is packed into KC x NC panels that stay in L3,
+ * A into MC x KC panels that stay in L2, and a 6x16 register-blocked micro-kernel walks
+ * MR x NR tiles of C using 12 ymm accumulators and FMA. Both operands are addressed through
+ * (row stride, column stride) pairs, so transposed operands cost nothing extra: they are
+ * untransposed while packing.
+ *
+ * Without AVX2/FMA the same blocking is used with a plain C++ micro-kernel.
+ *
+ * A may also be stored as bf16 or fp16 (see nn_half.hpp). It is widened to float while it is
+ * packed or streamed, so all arithmetic stays single precision and only the reads of A shrink.
+ */
+
+constexpr int GEMM_MR = 6;
+constexpr int GEMM_NR = 16;
+constexpr int GEMM_MC = 144; // multiple of GEMM_MR
+constexpr int GEMM_KC = 256;
+constexpr int GEMM_NC = 3072; // multiple of GEMM_NR
+
+struct GemmPackBuffers {
+    struct AlignedDelete {
+        void operator()(float *p) const { std::free(p); }
+    };
+
+    std::unique_ptr<float[], AlignedDelete> a{
+            static_cast<float *>(std::aligned_alloc(64, sizeof(float) * GEMM_MC * GEMM_KC))};
+    std::unique_ptr<float[], AlignedDelete> b{
+            static_cast<float *>(std::aligned_alloc(64, sizeof(float) * GEMM_KC * GEMM_NC))};
+
+    static GemmPackBuffers &local() {
+        static thread_local GemmPackBuffers bufs;
+        return bufs;
+    }
+};
+
+// Pack an mc x kc block of A into row panels of GEMM_MR, k-major inside each panel.
+template <typename TA>
+inline void gemm_pack_a(int mc, int kc, const TA *a, std::ptrdiff_t rs, std::ptrdiff_t cs, float *dst) {
+    for (int p = 0; p < mc; p += GEMM_MR) {
+        const int mr = std::min(GEMM_MR, mc - p);
+        for (int k = 0; k < kc; k++) {
+            for (int i = 0; i < mr; i++)
+                dst[i] = to_float(a[(p + i) * rs + k * cs]);
+            for (int i = mr; i < GEMM_MR; i++)
+                dst[i] = 0;
+            dst += GEMM_MR;
+        }
+    }
+}
+
+// Pack a kc x nc block of B into column panels of GEMM_NR, k-major inside each panel.
+inline void gemm_pack_b(int kc, int nc, const float *b, std::ptrdiff_t rs, std::ptrdiff_t cs, float *dst) {
+    for (int q = 0; q < nc; q += GEMM_NR) {
+        const int nr = std::min(GEMM_NR, nc - q);
+        for (int k = 0; k < kc; k++) {
+            const float *src = b + k * rs + q * cs;
+            if (cs == 1 && nr == GEMM_NR) {
+                std::memcpy(dst, src, sizeof(float) * GEMM_NR);
+            } else {
+                for (int j = 0; j < nr; j++)
+                    dst[j] = src[j * cs];
+                for (int j = nr; j < GEMM_NR; j++)
+                    dst[j] = 0;
+            }
+            dst += GEMM_NR;
+        }
+    }
+}
+
+// C[0:MR, 0:NR] += A_panel * B_panel, where C has row stride ldc and unit column stride.
+inline void gemm_micro_kernel(int kc, const float *a, const float *b, float *c, std::ptrdiff_t ldc) {
+#ifdef NN_GEMM_AVX2
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+
+    for (int k = 0; k < kc; k++) {
+        const __m256 b0 = _mm256_load_ps(b);
+        const __m256 b1 = _mm256_load_ps(b + 8);
+        __m256 av;
+
+        av = _mm256_broadcast_ss(a + 0); c00 = _mm256_fmadd_ps(av, b0, c00); c01 = _mm256_fmadd_ps(av, b1, c01);
+        av = _mm256_broadcast_ss(a + 1); c10 = _mm256_fmadd_ps(av, b0, c10); c11 = _mm256_fmadd_ps(av, b1, c11);
+        av = _mm256_broadcast_ss(a + 2); c20 = _mm256_fmadd_ps(av, b0, c20); c21 = _mm256_fmadd_ps(av, b1, c21);
+        av = _mm256_broadcast_ss(a + 3); c30 = _mm256_fmadd_ps(av, b0, c30); c31 = _mm256_fmadd_ps(av, b1, c31);
+        av = _mm256_broadcast_ss(a + 4); c40 = _mm256_fmadd_ps(av, b0, c40); c41 = _mm256_fmadd_ps(av, b1, c41);
+        av = _mm256_broadcast_ss(a + 5); c50 = _mm256_fmadd_ps(av, b0, c50); c51 = _mm256_fmadd_ps(av, b1, c51);
+
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    auto acc = [](float *dst, __m256 lo, __m256 hi) {
+        _mm256_storeu_ps(dst, _mm256_add_ps(_mm256_loadu_ps(dst), lo));
+        _mm256_storeu_ps(dst + 8, _mm256_add_ps(_mm256_loadu_ps(dst + 8), hi));
+    };
+
+    acc(c + 0 * ldc, c00, c01);
+    acc(c + 1 * ldc, c10, c11);
+    acc(c + 2 * ldc, c20, c21);
+    acc(c + 3 * ldc, c30, c31);
+    acc(c + 4 * ldc, c40, c41);
+    acc(c + 5 * ldc, c50, c51);
+#else
+    float tile[GEMM_MR][GEMM_NR] = {};
+    for (int k = 0; k < kc; k++) {
+        for (int i = 0; i < GEMM_MR; i++)
+            for (int j = 0; j < GEMM_NR; j++)
+                tile[i][j] += a[i] * b[j];
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    for (int i = 0; i < GEMM_MR; i++)
+        for (int j = 0; j < GEMM_NR; j++)
+            c[i * ldc + j] += tile[i][j];
+#endif
+}
+
+/**
+ * y = A * x (+ y if accumulate), with A being M x K in row-major order with leading dimension lda.
+ * This is the shape Layer::forward hits for a single sample; it is purely bandwidth bound, so A is
+ * streamed exactly once, four rows at a time. Strided x (a column of a batch matrix) is gathered first.
+ */
+template <typename TA>
+inline void gemv_f32(int m, int k, const TA *a, std::ptrdiff_t lda,
+                     const float *x, std::ptrdiff_t incx, float *y, std::ptrdiff_t incy,
+                     bool accumulate = false) {
+    if (incx != 1) {
+        static thread_local std::vector<float> gathered;
+        gathered.resize(k);
+        for (int c = 0; c < k; c++)
+            gathered[c] = x[c * incx];
+        x = gathered.data();
+    }
+
+    int r = 0;
+
+#ifdef NN_GEMM_AVX2
+    auto hsum = [](__m256 v) {
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s = _mm_add_ss(s, _mm_movehdup_ps(s));
+        return _mm_cvtss_f32(s);
+    };
+
+    for (; r + 4 <= m; r += 4) {
+        const TA *a0 = a + (r + 0) * lda, *a1 = a + (r + 1) * lda;
+        const TA *a2 = a + (r + 2) * lda, *a3 = a + (r + 3) * lda;
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+        __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+
+        int c = 0;
+        for (; c + 8 <= k; c += 8) {
+            const __m256 xv = _mm256_loadu_ps(x + c);
+            s0 = _mm256_fmadd_ps(load8_ps(a0 + c), xv, s0);
+            s1 = _mm256_fmadd_ps(load8_ps(a1 + c), xv, s1);
+            s2 = _mm256_fmadd_ps(load8_ps(a2 + c), xv, s2);
+            s3 = _mm256_fmadd_ps(load8_ps(a3 + c), xv, s3);
+        }
+
+        float t0 = hsum(s0), t1 = hsum(s1), t2 = hsum(s2), t3 = hsum(s3);
+        for (; c < k; c++) {
+            t0 += to_float(a0[c]) * x[c];
+            t1 += to_float(a1[c]) * x[c];
+            t2 += to_float(a2[c]) * x[c];
+            t3 += to_float(a3[c]) * x[c];
+        }
+
+        y[(r + 0) * incy] = (accumulate ? y[(r + 0) * incy] : 0) + t0;
+        y[(r + 1) * incy] = (accumulate ? y[(r + 1) * incy] : 0) + t1;
+        y[(r + 2) * incy] = (accumulate ? y[(r + 2) * incy] : 0) + t2;
+        y[(r + 3) * incy] = (accumulate ? y[(r + 3) * incy] : 0) + t3;
+    }
+#endif
+
+    for (; r < m; r++) {
+        const TA *ar = a + r * lda;
+        float t = 0;
+        for (int c = 0; c < k; c++)
+            t += to_float(ar[c]) * x[c];
+        y[r * incy] = (accumulate ? y[r * incy] : 0) + t;
+    }
+}
+
+/**
+ * y = A^T * x (+ y if accumulate), with A being K x M in row-major order with leading dimension lda.
+ * This is the single-sample backward pass through a layer: every row of A is streamed once and
+ * scaled into y, so no transposed copy of the weights is ever made.
+ */
+template <typename TA>
+inline void gemv_t_f32(int m, int k, const TA *a, std::ptrdiff_t lda,
+                       const float *x, std::ptrdiff_t incx, float *y, std::ptrdiff_t incy,
+                       bool accumulate = false) {
+    static thread_local std::vector<float> scratch;
+    float *acc = y;
+    if (incy != 1) {
+        scratch.resize(m);
+        acc = scratch.data();
+    }
+
+    for (int c = 0; c < m; c++)
+        acc[c] = accumulate ? y[c * incy] : 0;
+
+    for (int r = 0; r < k; r++) {
+        const TA *ar = a + r * lda;
+        const float xr = x[r * incx];
+        int c = 0;
+
+#ifdef NN_GEMM_AVX2
+        const __m256 xv = _mm256_set1_ps(xr);
+        for (; c + 8 <= m; c += 8)
+            _mm256_storeu_ps(acc + c, _mm256_fmadd_ps(load8_ps(ar + c), xv, _mm256_loadu_ps(acc + c)));
+#endif
+
+        for (; c < m; c++)
+            acc[c] += to_float(ar[c]) * xr;
+    }
+
+    if (incy != 1)
+        for (int c = 0; c < m; c++)
+            y[c * incy] = acc[c];
+}
+
+/**
+ * C = A * B (+ C if accumulate), with A being M x K, B being K x N and C being M x N.
+ * A and B are addressed as a[r * rs_a + c * cs_a]; C must have unit column stride.
+ */
+template <typename TA>
+inline void gemm_f32(int m, int n, int k,
+                     const TA *a, std::ptrdiff_t rs_a, std::ptrdiff_t cs_a,
+                     const float *b, std::ptrdiff_t rs_b, std::ptrdiff_t cs_b,
+                     float *c, std::ptrdiff_t ldc, bool accumulate = false) {
+    if (!accumulate)
+        for (int r = 0; r < m; r++)
+            std::fill_n(c + r * ldc, n, 0.0f);
+
+    if (m <= 0 || n <= 0 || k <= 0)
+        return;
+
+    // A single column is a matrix-vector product; packing A would only double the traffic.
+    if (n == 1 && cs_a == 1) {
+        gemv_f32(m, k, a, rs_a, b, rs_b, c, ldc, true);
+        return;
+    }
+
+    if (n == 1 && rs_a == 1) {
+        gemv_t_f32(m, k, a, cs_a, b, rs_b, c, ldc, true);
+        return;
+    }
+
+    GemmPackBuffers &bufs = GemmPackBuffers::local();
+    alignas(64) float edge[GEMM_MR * GEMM_NR];
+
+    for (int jc = 0; jc < n; jc += GEMM_NC) {
+        const int nc = std::min(GEMM_NC, n - jc);
+
+        for (int pc = 0; pc < k; pc += GEMM_KC) {
+            const int kc = std::min(GEMM_KC, k - pc);
+            gemm_pack_b(kc, nc, b + pc * rs_b + jc * cs_b, rs_b, cs_b, bufs.b.get());
+
+            for (int ic = 0; ic < m; ic += GEMM_MC) {
+                const int mc = std::min(GEMM_MC, m - ic);
+                gemm_pack_a(mc, kc, a + ic * rs_a + pc * cs_a, rs_a, cs_a, bufs.a.get());
+
+                for (int jr = 0; jr < nc; jr += GEMM_NR) {
+                    const int nr = std::min(GEMM_NR, nc - jr);
+                    const float *bp = bufs.b.get() + jr * kc;
+
+                    for (int ir = 0; ir < mc; ir += GEMM_MR) {
+                        const int mr = std::min(GEMM_MR, mc - ir);
+                        const float *ap = bufs.a.get() + ir * kc;
+                        float *cp = c + (ic + ir) * ldc + jc + jr;
+
+                        if (mr == GEMM_MR && nr == GEMM_NR) {
+                            gemm_micro_kernel(kc, ap, bp, cp, ldc);
+                        } else {
+                            std::fill_n(edge, GEMM_MR * GEMM_NR, 0.0f);
+                            gemm_micro_kernel(kc, ap, bp, edge, GEMM_NR);
+                            for (int i = 0; i < mr; i++)
+                                for (int j = 0; j < nr; j++)
+                                    cp[i * ldc + j] += edge[i * GEMM_NR + j];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NN_HALF_AVX2
+#if defined(__F16C__)
+#define NN_HALF_F16C
+#endif
+#endif
+
+/**
+ * 16-bit storage types for weights that are only read by the forward and backward passes. Nothing
+ * computes in them: loads widen to float (bf16 by a shift, fp16 with F16C) and all arithmetic and
+ * accumulation stays single precision.
+ *
+ *   bf16  float's exponent range with an 8-bit mantissa; cannot overflow where float does not
+ *   fp16  5-bit exponent, 11-bit mantissa; 3 more bits of precision, but saturates beyond 65504
+ */
+
+struct bf16 {
+    std::uint16_t bits;
+};
+
+struct fp16 {
+    std::uint16_t bits;
+};
+
+template <typename T>
+constexpr bool is_half_v = std::is_same_v<T, bf16> || std::is_same_v<T, fp16>;
+
+inline float to_float(float x) { return x; }
+
+inline float to_float(bf16 x) { return std::bit_cast<float>(std::uint32_t(x.bits) << 16); }
+
+inline float to_float(fp16 x) {
+#ifdef NN_HALF_F16C
+    return _cvtsh_ss(x.bits);
+#else
+    const std::uint32_t sign = std::uint32_t(x.bits & 0x8000) << 16;
+    const int exp = (x.bits >> 10) & 0x1f, mant = x.bits & 0x3ff;
+    if (exp == 0x1f) return std::bit_cast<float>(sign | 0x7f800000 | std::uint32_t(mant) << 13);
+    const float mag = exp ? std::ldexp(float(mant | 0x400), exp - 25) : std::ldexp(float(mant), -24);
+    return sign ? -mag : mag;
+#endif
+}
+
+// Round to nearest even, as the hardware conversions do
+inline void from_float(float x, float &out) { out = x; }
+
+inline void from_float(float x, bf16 &out) {
+    const std::uint32_t u = std::bit_cast<std::uint32_t>(x);
+    if ((u & 0x7fffffff) > 0x7f800000) { // NaN: keep it one
+        out.bits = std::uint16_t((u >> 16) | 0x40);
+        return;
+    }
+    out.bits = std::uint16_t((u + 0x7fff + ((u >> 16) & 1)) >> 16);
+}
+
+inline void from_float(float x, fp16 &out) {
+#ifdef NN_HALF_F16C
+    out.bits = _cvtss_sh(x, _MM_FROUND_TO_NEAREST_INT);
+#else
+    const std::uint32_t u = std::bit_cast<std::uint32_t>(x);
+    const auto sign = std::uint16_t((u >> 16) & 0x8000);
+    const float a = std::fabs(x);
+    if (std::isnan(x)) { out.bits = sign | 0x7e00; return; }
+    if (a >= 65520.0f) { out.bits = sign | 0x7c00; return; } // rounds to infinity
+    if (a == 0) { out.bits = sign; return; }
+
+    // Scale so that the fp16 ulp at a's exponent becomes 1, then round to nearest even there
+    int e;
+    std::frexp(a, &e);
+    const int ulp_exp = std::max(e - 11, -24);
+    const auto q = std::uint32_t(std::nearbyint(std::ldexp(a, -ulp_exp)));
+    if (ulp_exp == -24) { out.bits = sign | std::uint16_t(q); return; } // subnormal, or the smallest normal after rounding
+
+    // q is in [2^10, 2^11]; 2^11 carries into the exponent
+    const int biased = ulp_exp + 25;
+    out.bits = sign | std::uint16_t(((biased + (q >> 11)) << 10) | ((q >> (q >> 11)) & 0x3ff));
+#endif
+}
+
+// dst[i] = src[i] in the storage type of dst
+template <typename T>
+inline void convert_row(const float *src, T *dst, std::size_t n) {
+    std::size_t i = 0;
+#ifdef NN_HALF_F16C
+    if constexpr (std::is_same_v<T, fp16>) {
+        for (; i + 8 <= n; i += 8)
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                             _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+#endif
+    for (; i < n; i++)
+        from_float(src[i], dst[i]);
+}
+
+#ifdef NN_HALF_AVX2
+// Eight consecutive values widened to float
+inline __m256 load8_ps(const float *p) { return _mm256_loadu_ps(p); }
+
+inline __m256 load8_ps(const bf16 *p) {
+    const __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+}
+
+inline __m256 load8_ps(const fp16 *p) {
+#ifdef NN_HALF_F16C
+    return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+#else
+    float f[8];
+    for (int i = 0; i < 8; i++)
+        f[i] = to_float(p[i]);
+    return _mm256_loadu_ps(f);
+#endif
+}
+#endif
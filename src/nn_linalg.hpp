@@ -1,52 +1,25 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <cassert>
+#include <bitset>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <numbers>
 #include <random>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <type_traits>
+#include <vector>
 
-template <typename T>
-struct SigmoidActivation {
-    static inline constexpr T activate(T in) {
-        return 1 / (1 + std::exp((double) -in));
-    }
-
-    static inline constexpr T activate_prime(T in) {
-        return std::exp((double) -in) / std::pow(1 + std::exp((double) -in), 2);
-    }
-};
-
-template <typename T>
-struct IdentityActivation {
-    static inline constexpr T activate(T in) {
-        return in;
-    }
-
-    static inline constexpr T activate_prime(T) {
-        return 1;
-    }
-};
-
-template <typename T>
-inline constexpr T ReLU(T in) {
-    return std::max(0.0, in);
-}
-
-template <typename T>
-inline constexpr T ReLU_prime(T in) {
-    return in < 0 ? 0 : 1;
-}
-
-template <typename T>
-inline constexpr T GELU(T x) {
-    return x * (tanh(sqrt(2 / std::numbers::pi) * (x + 0.044715 * x * x * x))) / 2.0;
-}
-
-template <typename T>
-inline constexpr T GELU_prime(T x) {
-    return x * (1.0 + 0.134145 * x * x) * std::pow(1.0 / cosh(sqrt(2.0 / std::numbers::pi) * (x + 0.044715 * x * x * x)), 2.0) / sqrt(2 * std::numbers::pi) + 0.5 * (1.0 + tanh(sqrt(2.0 / std::numbers::pi) * (x + 0.044715 * x * x * x)));
-}
+#include "nn_activation.hpp"
+#include "nn_gemm.hpp"
+#include "nn_optim.hpp"
 
 inline double rng(double lo = -1, double hi = 1) {
     std::random_device rd;
@@ -55,6 +28,10 @@ inline double rng(double lo = -1, double hi = 1) {
     return dist(gen);
 }
 
+/**
+ * Non-owning R x C row-major view. Storage comes from an Arena (or anywhere else that outlives
+ * the view); copying a Matrix copies the pointer, not the elements. All arithmetic is in place.
+ */
 template <typename T, int R, int C>
 class Matrix {
     static_assert(R > 0);
@@ -65,123 +42,197 @@ public:
     typedef Matrix<T,R,C> self;
     constexpr static int rows = R;
     constexpr static int cols = C;
+    constexpr static std::size_t size = std::size_t(R) * C;
 
-    T dat[R][C];
+    T *dat = nullptr;
 
-    // constexpr inline Matrix() = default;
+    constexpr inline Matrix() = default;
+    constexpr inline explicit Matrix(T *storage) : dat(storage) {}
 
     constexpr inline T *operator[](std::size_t r) {
-        return dat[r];
+        return dat + r * C;
     }
 
     constexpr inline T &operator()(std::size_t r, std::size_t c) {
-        return dat[r][c];
+        return dat[r * C + c];
     }
 
     constexpr inline const T *operator[](std::size_t r) const {
-        return &dat[r][0];
+        return dat + r * C;
     }
 
     constexpr inline const T &operator()(std::size_t r, std::size_t c) const {
-        return dat[r][c];
+        return dat[r * C + c];
     }
 
-    constexpr inline self operator+(const self &rhs) const {
-        return self{*this} += rhs;
+    constexpr inline self &operator+=(const self &rhs) {
+        for (std::size_t i = 0; i < size; i++)
+            dat[i] += rhs.dat[i];
+        return *this;
     }
 
-    constexpr inline self &operator+=(const self &rhs) {
-        for (auto r = 0; r < rows; r++)
-            for (auto c = 0; c < cols; c++)
-                dat[r][c] += rhs.dat[r][c];
+    constexpr inline self &operator/=(T rhs) {
+        for (std::size_t i = 0; i < size; i++)
+            dat[i] /= rhs;
         return *this;
     }
 
-    constexpr inline self operator*(T rhs) const {
-        return self{*this} *= rhs;
+    constexpr inline self &operator*=(T rhs) {
+        for (std::size_t i = 0; i < size; i++)
+            dat[i] *= rhs;
+        return *this;
     }
 
-    constexpr inline self &operator/=(T rhs) {
-        for (auto r = 0; r < rows; r++)
-            for (auto c = 0; c< cols; c++)
-                dat[r][c] /= rhs;
+    // this += rhs * scale, in one pass
+    constexpr inline self &add_scaled(const self &rhs, T scale) {
+        for (std::size_t i = 0; i < size; i++)
+            dat[i] += rhs.dat[i] * scale;
         return *this;
     }
 
-    constexpr inline self operator/(T rhs) const {
-        return self{*this} /= rhs;
+    constexpr inline self &fill(T val) {
+        std::fill_n(dat, size, val);
+        return *this;
     }
 
-    constexpr inline self &operator*=(T rhs) {
-        for (auto r = 0; r < rows; r++)
-            for (auto c = 0; c < cols; c++)
-                dat[r][c] *= rhs;
+    constexpr inline self &copy_from(const self &rhs) {
+        std::copy_n(rhs.dat, size, dat);
         return *this;
     }
 
-    template <int O>
-    constexpr inline Matrix<T, R, O> operator*(const Matrix<T, C, O> &rhs) const {
-        Matrix<T, R, O> x;
-        for (auto r = 0; r < R; r++)
-            for (auto c = 0; c < O; c++)
-                x.dat[r][c] = 0;
+    // this = lhs * rhs (+ this if accumulate)
+    template <int K>
+    constexpr inline self &mul(const Matrix<T, R, K> &lhs, const Matrix<T, K, C> &rhs, bool accumulate = false) {
+        if constexpr (std::is_same_v<T, float>) {
+            if (!std::is_constant_evaluated()) {
+                if constexpr (C == 1)
+                    gemv_f32(R, K, lhs.dat, K, rhs.dat, 1, dat, 1, accumulate);
+                else
+                    gemm_f32(R, C, K, lhs.dat, K, 1, rhs.dat, C, 1, dat, C, accumulate);
+                return *this;
+            }
+        }
+
+        if (!accumulate)
+            fill(0);
 
         for (auto r = 0; r < R; r++)
-            for (auto c = 0; c < O; c++)
-                for (auto mr = 0; mr < C; mr++)
-                    x.dat[r][c] += rhs.dat[mr][c] * dat[r][mr];
-        return x;
+            for (auto c = 0; c < C; c++)
+                for (auto k = 0; k < K; k++)
+                    (*this)(r, c) += lhs(r, k) * rhs(k, c);
+        return *this;
     }
 
-    constexpr inline Matrix<T, C, R> transpose() const {
-        Matrix<T, C, R> x;
+    constexpr inline void transpose_into(Matrix<T, C, R> &x) const {
         for (int r = 0; r < rows; r++)
             for (int c = 0; c < cols; c++)
-                x[c][r] = dat[r][c];
-        return x;
+                x[c][r] = (*this)(r, c);
     }
 
     [[nodiscard]] std::string to_string() const {
         std::string ret;
         for (auto r = 0; r < rows; r++) {
             for (auto c = 0; c < cols; c++)
-                ret += std::to_string(dat[r][c]) + "\t";
+                ret += std::to_string((*this)(r, c)) + "\t";
             ret += "\n";
         }
 
         return ret;
     }
 
-    constexpr static inline self zeroed() {
-        self ret;
-        for (auto r = 0; r < rows; r++)
-            for (auto c = 0; c < cols; c++)
-                ret.dat[r][c] = 0;
-        return ret;
-    }
-
-    constexpr inline self &func_map_ip(const std::function<T(T)> &func) {
-        for (auto r = 0; r < rows; r++)
-            for (auto c = 0; c < cols; c++)
-                dat[r][c] = func(dat[r][c]);
+    template <typename F>
+    constexpr inline self &func_map_ip(F &&func) {
+        for (std::size_t i = 0; i < size; i++)
+            dat[i] = func(dat[i]);
         return *this;
     }
 
-    constexpr inline self func_map(const std::function<T(T)> &func) {
-        return self{*this}.func_map_ip(func);
-    }
-
     void randomize(T lo = -1, T hi = 1) {
         std::random_device rd;
         std::mt19937_64 gen(rd());
         std::uniform_real_distribution<T> dist(lo, hi);
 
-        for (auto r = 0; r < rows; r++)
-            for (auto c = 0; c < cols; c++)
-                dat[r][c] = dist(gen);
+        for (std::size_t i = 0; i < size; i++)
+            dat[i] = dist(gen);
     }
 };
 
+/**
+ * A single 64-byte aligned, zero-initialised allocation that hands out Matrix views.
+ *
+ * The allocation is split into sections so that everything of one kind is contiguous no matter
+ * which layer it belongs to: all parameters first, then all gradient accumulators, then the
+ * per-sample buffers, then the reduced precision copies of parameters that the passes read
+ * instead of the originals. Owners describe how much they need with a Footprint, sum them up
+ * front, and then take() their matrices in any order.
+ */
+class Arena {
+public:
+    enum Section { PARAMS, GRADS, STATE, SHADOW, SECTION_NB };
+    using Footprint = std::array<std::size_t, SECTION_NB>;
+
+    constexpr static std::size_t ALIGN = 64;
+
+    constexpr static std::size_t padded(std::size_t bytes) {
+        return (bytes + ALIGN - 1) / ALIGN * ALIGN;
+    }
+
+    template <typename T, int R, int C>
+    constexpr static Footprint footprint_of(Section s, std::size_t count = 1) {
+        Footprint f{};
+        f[s] = count * padded(sizeof(T) * R * C);
+        return f;
+    }
+
+    template <typename... Fs>
+    constexpr static Footprint sum(const Fs &...fs) {
+        Footprint f{};
+        for (int s = 0; s < SECTION_NB; s++)
+            f[s] = (std::size_t{0} + ... + fs[s]);
+        return f;
+    }
+
+    explicit Arena(const Footprint &f) {
+        std::size_t total = 0;
+        for (int s = 0; s < SECTION_NB; s++) {
+            begin[s] = cursor[s] = total;
+            total += padded(f[s]);
+            end[s] = total;
+        }
+
+        mem.reset(static_cast<std::byte *>(std::aligned_alloc(ALIGN, std::max(total, ALIGN))));
+        std::memset(mem.get(), 0, total);
+    }
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    template <typename T, int R, int C>
+    Matrix<T, R, C> take(Section s) {
+        const std::size_t off = cursor[s];
+        cursor[s] += padded(sizeof(T) * R * C);
+        // Checked in release builds too: overrunning a section silently aliases the next one
+        if (cursor[s] > end[s]) {
+            std::cerr << "Arena footprint is too small: section " << s << " needs " << cursor[s] - begin[s]
+                      << " bytes, has " << end[s] - begin[s] << '\n';
+            std::abort();
+        }
+        return Matrix<T, R, C>{reinterpret_cast<T *>(mem.get() + off)};
+    }
+
+    [[nodiscard]] std::byte *section(Section s) { return mem.get() + begin[s]; }
+    [[nodiscard]] const std::byte *section(Section s) const { return mem.get() + begin[s]; }
+    [[nodiscard]] std::size_t section_bytes(Section s) const { return end[s] - begin[s]; }
+
+private:
+    struct FreeDelete {
+        void operator()(std::byte *p) const { std::free(p); }
+    };
+
+    std::unique_ptr<std::byte[], FreeDelete> mem;
+    std::size_t begin[SECTION_NB]{}, cursor[SECTION_NB]{}, end[SECTION_NB]{};
+};
+
 using NumericT = float;
 
 template <int R, int C>
@@ -190,92 +241,437 @@ using Mat = Matrix<NumericT, R, C>;
 template <int D>
 using Vec = Mat<D, 1>;
 
+namespace linalg_detail {
+struct FreeDelete {
+    void operator()(NumericT *p) const { std::free(p); }
+};
+}
 
-template <int InpNo, int OutNo, typename Activation = SigmoidActivation<NumericT>>
+// This thread's aligned scratch of at least floats floats, grown on first use and then reused; the
+// gathered columns of a wide layer are far too large for the stack
+inline NumericT *gather_scratch(std::size_t floats) {
+    thread_local std::unique_ptr<NumericT[], linalg_detail::FreeDelete> buf;
+    thread_local std::size_t capacity = 0;
+    if (floats > capacity) {
+        capacity = Arena::padded(floats * sizeof(NumericT)) / sizeof(NumericT);
+        buf.reset(static_cast<NumericT *>(std::aligned_alloc(Arena::ALIGN, capacity * sizeof(NumericT))));
+    }
+    return buf.get();
+}
+
+/**
+ * Activation kernels over the first n columns of R x Batch per-sample buffers, whose rows are
+ * Batch apart. A full batch is one contiguous block and takes a single call; fewer columns than a
+ * vector holds are gathered into a contiguous column each, so a lone sample is not left to the
+ * scalar tails; anything in between goes row by row.
+ */
+template <typename Activation, int R, int Batch>
+inline void activate_cols(const Mat<R, Batch> &z, Mat<R, Batch> &a, int n) {
+    if (n == Batch) {
+        Activation::activate_n(z.dat, a.dat, R * Batch);
+    } else if (n < 8) {
+        constexpr std::size_t stride = Arena::padded(R * sizeof(NumericT)) / sizeof(NumericT);
+        NumericT *zc = gather_scratch(2 * stride), *ac = zc + stride;
+        for (int b = 0; b < n; b++) {
+            for (int i = 0; i < R; i++)
+                zc[i] = z[i][b];
+            Activation::activate_n(zc, ac, R);
+            for (int i = 0; i < R; i++)
+                a[i][b] = ac[i];
+        }
+    } else {
+        for (int i = 0; i < R; i++)
+            Activation::activate_n(z[i], a[i], n);
+    }
+}
+
+// dZ = dA * activation'(z) over the first n columns, laid out as in activate_cols()
+template <typename Activation, int R, int Batch>
+inline void backward_cols(const Mat<R, Batch> &z, const Mat<R, Batch> &a, const Mat<R, Batch> &dA,
+                          Mat<R, Batch> &dZ, int n) {
+    if (n == Batch) {
+        Activation::backward_n(z.dat, a.dat, dA.dat, dZ.dat, R * Batch);
+    } else if (n < 8) {
+        constexpr std::size_t stride = Arena::padded(R * sizeof(NumericT)) / sizeof(NumericT);
+        NumericT *zc = gather_scratch(4 * stride), *ac = zc + stride, *dac = ac + stride, *dzc = dac + stride;
+        for (int b = 0; b < n; b++) {
+            for (int i = 0; i < R; i++) {
+                zc[i] = z[i][b];
+                ac[i] = a[i][b];
+                dac[i] = dA[i][b];
+            }
+            Activation::backward_n(zc, ac, dac, dzc, R);
+            for (int i = 0; i < R; i++)
+                dZ[i][b] = dzc[i];
+        }
+    } else {
+        for (int i = 0; i < R; i++)
+            Activation::backward_n(z[i], a[i], dA[i], dZ[i], n);
+    }
+}
+
+
+/**
+ * Fully connected layer. The layer itself only holds parameters; everything a forward/backward pass
+ * writes lives in a State (per-sample buffers) and a Grads (gradient accumulators), so any number
+ * of threads can run the same layer at once with their own State and Grads.
+ *
+ * With a 16-bit StoreT (bf16 or fp16), the passes read the weights from a copy in that type, which
+ * halves the traffic of the weight-bound GEMMs; weights stays the fp32 master copy that is
+ * updated, saved and quantized, and apply_backprop() refreshes the copy row by row.
+ */
+template <int InpNo, int OutNo, typename Activation = SigmoidActivation<NumericT>, int Batch = 1,
+          typename StoreT = NumericT>
 class Layer {
 public:
+    // Every per-sample buffer holds up to Batch samples, one per column; only the first n are used.
+    using Inp = Mat<InpNo, Batch>;
+    using Out = Mat<OutNo, Batch>;
+
+    constexpr static int outputs = OutNo;
+    constexpr static bool shadowed = !std::is_same_v<StoreT, NumericT>;
+
+    constexpr static Arena::Footprint footprint = Arena::sum(
+            Arena::footprint_of<NumericT, OutNo, InpNo>(Arena::PARAMS),
+            Arena::footprint_of<NumericT, OutNo, 1>(Arena::PARAMS),
+            Arena::footprint_of<StoreT, OutNo, InpNo>(Arena::SHADOW, shadowed ? 1 : 0));
+
+    struct Grads {
+        constexpr static Arena::Footprint footprint = Arena::sum(
+                Arena::footprint_of<NumericT, OutNo, InpNo>(Arena::GRADS),
+                Arena::footprint_of<NumericT, OutNo, 1>(Arena::GRADS));
+
+        Mat<OutNo, InpNo> weight_step_acc;
+        Vec<OutNo> bias_step_acc;
+        NumericT num_backprops = 0;
+
+        explicit Grads(Arena &arena)
+                : weight_step_acc(arena.take<NumericT, OutNo, InpNo>(Arena::GRADS)),
+                  bias_step_acc(arena.take<NumericT, OutNo, 1>(Arena::GRADS)) {}
+    };
+
+    struct State {
+        constexpr static Arena::Footprint footprint = Arena::sum(
+                Arena::footprint_of<NumericT, OutNo, Batch>(Arena::STATE, 3),
+                Arena::footprint_of<NumericT, InpNo, Batch>(Arena::STATE));
+
+        Out z_act;
+        Out activation;
+        Out dCost_dZ;
+        Inp dCost_dActPrev;
+        Inp input; // view of the previous layer's activation
+
+        explicit State(Arena &arena)
+                : z_act(arena.take<NumericT, OutNo, Batch>(Arena::STATE)),
+                  activation(arena.take<NumericT, OutNo, Batch>(Arena::STATE)),
+                  dCost_dZ(arena.take<NumericT, OutNo, Batch>(Arena::STATE)),
+                  dCost_dActPrev(arena.take<NumericT, InpNo, Batch>(Arena::STATE)) {}
+    };
+
     Mat<OutNo, InpNo> weights;
     Vec<OutNo> biases;
-
-    Mat<OutNo, InpNo> weight_step_acc = Mat<OutNo, InpNo>::zeroed();
-    Vec<OutNo> bias_step_acc = Vec<OutNo>::zeroed();
-    NumericT num_backprops = 0;
     NumericT learn_rate = 0.1, bias_learn = 1;
 
-    Vec<OutNo> z_act;
-    Vec<OutNo> activation;
-    Vec<InpNo> *input;
+    // weights in StoreT, as forward() and backward() read them; only taken if shadowed
+    Matrix<StoreT, OutNo, InpNo> stored{};
+
+    // Optimizer state shaped like weights and biases, one per slot; unbound (null) for plain SGD
+    Mat<OutNo, InpNo> weight_moments[OPTIM_SLOTS]{};
+    Vec<OutNo> bias_moments[OPTIM_SLOTS]{};
+
+    explicit Layer(Arena &arena)
+            : weights(arena.take<NumericT, OutNo, InpNo>(Arena::PARAMS)),
+              biases(arena.take<NumericT, OutNo, 1>(Arena::PARAMS)) {
+        if constexpr (shadowed)
+            stored = arena.take<StoreT, OutNo, InpNo>(Arena::SHADOW);
+    }
 
-    inline constexpr void apply_backprop() {
-        if (num_backprops <= 0) return;
+    // Weights as the passes read them
+    [[nodiscard]] const StoreT *read_weights() const {
+        if constexpr (shadowed) return stored.dat;
+        else return weights.dat;
+    }
 
-        biases += (bias_step_acc *= (bias_learn * learn_rate / num_backprops));
-        weights += (weight_step_acc *= (learn_rate / num_backprops));
+    // Bring the StoreT copy of rows [row_begin, row_end) up to date with weights
+    inline void sync_stored(int row_begin = 0, int row_end = OutNo) {
+        if constexpr (shadowed)
+            for (int i = row_begin; i < row_end; i++)
+                convert_row(weights[i], stored[i], InpNo);
+    }
 
-        num_backprops = 0;
-        weight_step_acc = Mat<OutNo, InpNo>::zeroed();
-        bias_step_acc = Vec<OutNo>::zeroed();
+    inline void apply_backprop(Grads &g, const OptimStep &s = {}) {
+        apply_backprop(g, 0, OutNo, s);
+        g.num_backprops = 0;
     }
 
+    // Apply and clear the accumulated step for neurons [row_begin, row_end) only, so disjoint ranges can run in parallel
+    inline void apply_backprop(Grads &g, int row_begin, int row_end, const OptimStep &s = {}) {
+        if (g.num_backprops <= 0) return;
 
-    inline constexpr Vec<InpNo> backward(const Vec<OutNo> &dCost_dAct) {
-        // dAct is the derivative of the cost with respect to our activation
-        num_backprops++;
+        const NumericT lr = learn_rate * s.rate, grad_scale = 1 / g.num_backprops;
+        auto row = [](auto &moments, int i) { return moments.dat ? moments[i] : nullptr; };
 
-        // derivative of the cost with respect to the activation of the previous layer
-        Vec<InpNo> dCost_dActPrev = Vec<InpNo>::zeroed();
+        optimizer_step(s, lr * bias_learn, grad_scale, biases[row_begin], g.bias_step_acc[row_begin],
+                       row(bias_moments[0], row_begin), row(bias_moments[1], row_begin), row_end - row_begin);
 
-        for (int i = 0; i < OutNo; i++) {
-            // derivative of activation with respect to Z
-            const NumericT dAct_dZ = Activation::activate_prime(z_act[i][0]);
+        for (int i = row_begin; i < row_end; i++) {
+            optimizer_step(s, lr, grad_scale, weights[i], g.weight_step_acc[i],
+                           row(weight_moments[0], i), row(weight_moments[1], i), InpNo);
+            sync_stored(i, i + 1); // while the row is still in cache
+        }
+    }
 
-            // derivative of cost with respect to bias;
-            const NumericT dCost_dZ = dCost_dAct[i][0] * dAct_dZ;
+    /**
+     * Accumulate the gradient of the first n samples of the last forward() on st into g.
+     * @param dCost_dAct Derivative of the cost with respect to our activation, one column per sample
+     * @return Derivative of the cost with respect to the previous layer's activation
+     */
+    inline const Inp &backward(State &st, Grads &g, const Out &dCost_dAct, int n = Batch) const {
+        g.num_backprops += n;
 
-            // no term for derivative of Z with respect to bias since dZ_dBias = 1
-            const NumericT dCost_dBias = dCost_dZ;
-            bias_step_acc[i][0] += dCost_dBias;
+        // derivative of activation with respect to Z, from the cached Z and activation
+        backward_cols<Activation>(st.z_act, st.activation, dCost_dAct, st.dCost_dZ, n);
 
-            for (int j = 0; j < InpNo; j++) {
-                const NumericT dZ_dWeight = input->dat[j][0]; // equal to the activation of the previous layer!
-                const NumericT dCost_dWeight = dCost_dZ * dZ_dWeight;
-                weight_step_acc[i][j] += dCost_dWeight;
+        // no term for derivative of Z with respect to bias since dZ_dBias = 1
+        for (int i = 0; i < OutNo; i++)
+            for (int b = 0; b < n; b++)
+                g.bias_step_acc[i][0] += st.dCost_dZ[i][b];
 
-                const NumericT dZ_dActPrev = weights[i][j]; // equal to the weight connecting that neuron to us
-                dCost_dActPrev[j][0] += dCost_dZ * dZ_dActPrev;
-            }
-        }
+        // dZ_dWeight is the activation of the previous layer, so the weight gradient is dCost_dZ * input^T
+        gemm_f32(OutNo, InpNo, n, st.dCost_dZ.dat, Batch, 1, st.input.dat, 1, Batch,
+                 g.weight_step_acc.dat, InpNo, true);
 
-        return dCost_dActPrev;
+        // dZ_dActPrev is the weight connecting that neuron to us, so this is weights^T * dCost_dZ
+        gemm_f32(InpNo, n, OutNo, read_weights(), 1, InpNo, st.dCost_dZ.dat, Batch, 1,
+                 st.dCost_dActPrev.dat, Batch);
+
+        return st.dCost_dActPrev;
     }
 
-    inline constexpr void forward() {
-        z_act = weights * (*input) + biases;
+    inline void forward(State &st, int n = Batch) const {
+        gemm_f32(OutNo, n, InpNo, read_weights(), InpNo, 1, st.input.dat, Batch, 1, st.z_act.dat, Batch);
+
         for (auto i = 0; i < OutNo; i++)
-            activation[i][0] = Activation::activate(z_act[i][0]);
+            for (auto b = 0; b < n; b++)
+                st.z_act[i][b] += biases[i][0];
+        activate_cols<Activation>(st.z_act, st.activation, n);
     }
 
-    constexpr Vec<OutNo> init_backwards(const Vec<OutNo> &desired) {
-        Vec<OutNo> dCdA;
+    // dCdA = derivative of the squared error against desired, for the first n samples
+    constexpr void init_backwards(const State &st, const Out &desired, Out &dCdA, int n = Batch) const {
         for (int i = 0; i < OutNo; i++)
-            dCdA[i][0] = 2 * (desired[i][0] - activation[i][0]);
-        return dCdA;
+            for (int b = 0; b < n; b++)
+                dCdA[i][b] = 2 * (desired[i][b] - st.activation[i][b]);
     }
 
     void randomize(NumericT lo = -1, NumericT hi = 1) {
         weights.randomize(lo, hi);
         biases.randomize(lo, hi);
+        sync_stored();
     }
 
     void load(std::ifstream &stream) {
-        stream.read((char *) &weights.dat[0][0], (InpNo * OutNo + OutNo) * sizeof(NumericT));
+        stream.read((char *) weights.dat, weights.size * sizeof(NumericT));
+        stream.read((char *) biases.dat, biases.size * sizeof(NumericT));
+        sync_stored();
     }
 
     void save(std::ofstream &stream) {
-        stream.write((char *) &weights.dat[0][0], (InpNo * OutNo + OutNo) * sizeof(NumericT));
+        stream.write((const char *) weights.dat, weights.size * sizeof(NumericT));
+        stream.write((const char *) biases.dat, biases.size * sizeof(NumericT));
     }
 };
 
+/**
+ * Input vector that is almost entirely zero: the listed indices are 1, the last DenseNo inputs
+ * carry explicit values, and everything else is 0.
+ */
+template <int InpNo, int MaxActive, int DenseNo = 1>
+struct SparseInput {
+    static_assert(InpNo <= 65536);
+    constexpr static int inputs = InpNo;
+    constexpr static int max_active = MaxActive;
+    constexpr static int dense_no = DenseNo;
+    constexpr static int dense_begin = InpNo - DenseNo;
+
+    std::uint16_t count = 0;
+    std::uint16_t idx[MaxActive];
+    NumericT dense[DenseNo];
+};
+
+/**
+ * First layer of a network whose input is a SparseInput. Weights are stored input-major, so the
+ * contribution of one active input is a contiguous row: forward sums the rows of the active inputs
+ * and backward only touches those rows. There is no gradient with respect to the input.
+ */
+template <typename Input, int OutNo, typename Activation = SigmoidActivation<NumericT>, int Batch = 1>
+class SparseLayer {
+public:
+    constexpr static int InpNo = Input::inputs;
+    constexpr static int outputs = OutNo;
+    using Out = Mat<OutNo, Batch>;
+
+    constexpr static Arena::Footprint footprint = Arena::sum(
+            Arena::footprint_of<NumericT, InpNo, OutNo>(Arena::PARAMS),
+            Arena::footprint_of<NumericT, OutNo, 1>(Arena::PARAMS));
+
+    struct Grads {
+        constexpr static Arena::Footprint footprint = Arena::sum(
+                Arena::footprint_of<NumericT, InpNo, OutNo>(Arena::GRADS),
+                Arena::footprint_of<NumericT, OutNo, 1>(Arena::GRADS));
+
+        Mat<InpNo, OutNo> weight_step_acc;
+        Vec<OutNo> bias_step_acc;
+        std::bitset<InpNo> touched{};
+        NumericT num_backprops = 0;
+
+        explicit Grads(Arena &arena)
+                : weight_step_acc(arena.take<NumericT, InpNo, OutNo>(Arena::GRADS)),
+                  bias_step_acc(arena.take<NumericT, OutNo, 1>(Arena::GRADS)) {}
+    };
+
+    struct State {
+        constexpr static Arena::Footprint footprint = Arena::footprint_of<NumericT, OutNo, Batch>(Arena::STATE, 3);
+
+        Out z_act;
+        Out activation;
+        Out dCost_dZ;
+        Input *input;
+
+        explicit State(Arena &arena)
+                : z_act(arena.take<NumericT, OutNo, Batch>(Arena::STATE)),
+                  activation(arena.take<NumericT, OutNo, Batch>(Arena::STATE)),
+                  dCost_dZ(arena.take<NumericT, OutNo, Batch>(Arena::STATE)) {}
+    };
+
+    Mat<InpNo, OutNo> weights; // weights[j] holds what input j adds to every neuron
+    Vec<OutNo> biases;
+    unsigned generation = 0; // bumped whenever the weights change, so cached sums can be invalidated
+    NumericT learn_rate = 0.1, bias_learn = 1;
+
+    // As in Layer. Rows of inputs that were not active keep their moments as they are (lazy update)
+    Mat<InpNo, OutNo> weight_moments[OPTIM_SLOTS]{};
+    Vec<OutNo> bias_moments[OPTIM_SLOTS]{};
+
+    explicit SparseLayer(Arena &arena)
+            : weights(arena.take<NumericT, InpNo, OutNo>(Arena::PARAMS)),
+              biases(arena.take<NumericT, OutNo, 1>(Arena::PARAMS)) {}
+
+    inline void apply_backprop(Grads &g, const OptimStep &s = {}) {
+        if (g.num_backprops <= 0) return;
+
+        const NumericT lr = learn_rate * s.rate, grad_scale = 1 / g.num_backprops;
+        auto row = [](auto &moments, int j) { return moments.dat ? moments[j] : nullptr; };
+
+        optimizer_step(s, lr * bias_learn, grad_scale, biases.dat, g.bias_step_acc.dat, bias_moments[0].dat,
+                       bias_moments[1].dat, OutNo);
+
+        for (int j = 0; j < InpNo; j++)
+            if (g.touched[j])
+                optimizer_step(s, lr, grad_scale, weights[j], g.weight_step_acc[j], row(weight_moments[0], j),
+                               row(weight_moments[1], j), OutNo);
+
+        g.touched.reset();
+        g.num_backprops = 0;
+        generation++;
+    }
+
+    inline void backward(State &st, Grads &g, const Out &dCost_dAct, int n = Batch) const {
+        g.num_backprops += n;
+
+        backward_cols<Activation>(st.z_act, st.activation, dCost_dAct, st.dCost_dZ, n);
+        for (int i = 0; i < OutNo; i++)
+            for (int b = 0; b < n; b++)
+                g.bias_step_acc[i][0] += st.dCost_dZ[i][b];
+
+        NumericT dCost_dZ[OutNo];
+        for (int b = 0; b < n; b++) {
+            for (int i = 0; i < OutNo; i++)
+                dCost_dZ[i] = st.dCost_dZ[i][b];
+
+            // dZ_dWeight is the input itself: 1 for active inputs, 0 (no update at all) for the rest
+            const Input &in = st.input[b];
+            for (int a = 0; a < in.count; a++) {
+                const int j = in.idx[a];
+                g.touched[j] = true;
+                for (int i = 0; i < OutNo; i++)
+                    g.weight_step_acc[j][i] += dCost_dZ[i];
+            }
+
+            for (int d = 0; d < Input::dense_no; d++) {
+                const int j = Input::dense_begin + d;
+                g.touched[j] = true;
+                for (int i = 0; i < OutNo; i++)
+                    g.weight_step_acc[j][i] += dCost_dZ[i] * in.dense[d];
+            }
+        }
+    }
+
+    inline void forward(State &st, int n = Batch) const {
+        NumericT z[OutNo];
+        for (int b = 0; b < n; b++) {
+            accumulate(st.input[b], z);
+            for (int i = 0; i < OutNo; i++)
+                st.z_act[i][b] = z[i];
+        }
+        activate_cols<Activation>(st.z_act, st.activation, n);
+    }
 
+    // Forward column b from an already accumulated pre-activation, e.g. an incrementally updated one
+    inline void forward_from(State &st, const NumericT *z, int b) const {
+        NumericT a[OutNo];
+        Activation::activate_n(z, a, OutNo);
+        for (int i = 0; i < OutNo; i++) {
+            st.z_act[i][b] = z[i];
+            st.activation[i][b] = a[i];
+        }
+    }
+
+    // z = biases + the weight rows of every active input of in
+    inline void accumulate(const Input &in, NumericT *z) const {
+        for (int i = 0; i < OutNo; i++)
+            z[i] = biases[i][0];
 
+        for (int a = 0; a < in.count; a++) {
+            const NumericT *row = weights[in.idx[a]];
+            for (int i = 0; i < OutNo; i++)
+                z[i] += row[i];
+        }
+
+        for (int d = 0; d < Input::dense_no; d++) {
+            const NumericT *row = weights[Input::dense_begin + d];
+            for (int i = 0; i < OutNo; i++)
+                z[i] += row[i] * in.dense[d];
+        }
+    }
 
+    void randomize(NumericT lo = -1, NumericT hi = 1) {
+        weights.randomize(lo, hi);
+        biases.randomize(lo, hi);
+        generation++;
+    }
+
+    // Same on-disk layout as Layer: output-major weights followed by the biases
+
+    void load(std::ifstream &stream) {
+        std::vector<NumericT> buf(weights.size);
+        stream.read((char *) buf.data(), buf.size() * sizeof(NumericT));
+        stream.read((char *) biases.dat, biases.size * sizeof(NumericT));
+
+        for (int i = 0; i < OutNo; i++)
+            for (int j = 0; j < InpNo; j++)
+                weights[j][i] = buf[std::size_t(i) * InpNo + j];
+
+        generation++;
+    }
+
+    void save(std::ofstream &stream) {
+        std::vector<NumericT> buf(weights.size);
+        for (int i = 0; i < OutNo; i++)
+            for (int j = 0; j < InpNo; j++)
+                buf[std::size_t(i) * InpNo + j] = weights[j][i];
+
+        stream.write((const char *) buf.data(), buf.size() * sizeof(NumericT));
+        stream.write((const char *) biases.dat, biases.size * sizeof(NumericT));
+    }
+};
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <numbers>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define NN_OPT_AVX2
+#endif
+
+/**
+ * Optimizers for Layer::apply_backprop(). Gradient accumulators hold the summed descent direction
+ * of num_backprops samples; every optimizer turns that into a weight update, clears the
+ * accumulator and advances its own state in one pass, so a step reads and writes each parameter,
+ * accumulator and moment exactly once.
+ *
+ *   SGD       w += lr * d
+ *   MOMENTUM  m = momentum * m + d;                          w += lr * m
+ *   ADAM      m = b1 * m + (1 - b1) * d;  v = b2 * v + (1 - b2) * d^2;
+ *             w += lr * m / (1 - b1^t) / (sqrt(v / (1 - b2^t)) + eps)
+ *
+ * where d is the mean accumulated direction. A nonzero weight_decay shrinks w by lr * weight_decay
+ * * w in the same pass, decoupled from the moments as in AdamW.
+ */
+
+enum class OptimizerKind : std::uint32_t {
+    SGD = 0,
+    MOMENTUM = 1,
+    ADAM = 2,
+};
+
+// Moment buffers the optimizers keep at most, each laid out like the parameters
+constexpr int OPTIM_SLOTS = 2;
+
+struct Optimizer {
+    OptimizerKind kind = OptimizerKind::SGD;
+    double learn_rate = 1; // multiplies every layer's own learn_rate
+    double momentum = 0.9;
+    double beta1 = 0.9, beta2 = 0.999, eps = 1e-8;
+    double weight_decay = 0;
+
+    [[nodiscard]] int slots() const {
+        return kind == OptimizerKind::ADAM ? 2 : kind == OptimizerKind::MOMENTUM ? 1 : 0;
+    }
+
+    static Optimizer sgd() { return {}; }
+
+    static Optimizer with_momentum(double momentum = 0.9) {
+        Optimizer o;
+        o.kind = OptimizerKind::MOMENTUM;
+        o.momentum = momentum;
+        return o;
+    }
+
+    // Layers default to a learn_rate of 0.1, so the effective rate is 0.1 * learn_rate
+    static Optimizer adam(double learn_rate = 0.01, double weight_decay = 0) {
+        Optimizer o;
+        o.kind = OptimizerKind::ADAM;
+        o.learn_rate = learn_rate;
+        o.weight_decay = weight_decay;
+        return o;
+    }
+};
+
+// What one apply_backprop() of every layer shares; the default is plain SGD at the layer's rate
+struct OptimStep {
+    OptimizerKind kind = OptimizerKind::SGD;
+    float rate = 1; // optimizer learn_rate times the schedule, before the layer's own rate
+    float momentum = 0, beta1 = 0, beta2 = 0, eps = 0, weight_decay = 0;
+    float correct1 = 1, correct2 = 1; // Adam's bias corrections 1 / (1 - beta^t)
+
+    // Step t (counting from 1) of o, at the given schedule multiplier
+    static OptimStep of(const Optimizer &o, std::uint64_t t, double schedule) {
+        OptimStep s;
+        s.kind = o.kind;
+        s.rate = float(o.learn_rate * schedule);
+        s.momentum = float(o.momentum);
+        s.beta1 = float(o.beta1);
+        s.beta2 = float(o.beta2);
+        s.eps = float(o.eps);
+        s.weight_decay = float(o.weight_decay);
+        s.correct1 = float(1 / (1 - std::pow(o.beta1, double(t))));
+        s.correct2 = float(1 / (1 - std::pow(o.beta2, double(t))));
+        return s;
+    }
+};
+
+/**
+ * Update n parameters w from their accumulators acc (which are cleared) and moments m and v, which
+ * may be null when s.kind does not use them. lr is the layer's rate times s.rate and grad_scale is
+ * 1 / num_backprops.
+ */
+inline void optimizer_step(const OptimStep &s, float lr, float grad_scale, float *__restrict w,
+                           float *__restrict acc, float *__restrict m, float *__restrict v, std::size_t n) {
+    const float keep = 1 - lr * s.weight_decay;
+    std::size_t i = 0;
+
+    switch (s.kind) {
+        case OptimizerKind::SGD: {
+            const float scale = lr * grad_scale;
+#ifdef NN_OPT_AVX2
+            const __m256 vkeep = _mm256_set1_ps(keep), vscale = _mm256_set1_ps(scale), zero = _mm256_setzero_ps();
+            for (; i + 8 <= n; i += 8) {
+                const __m256 d = _mm256_loadu_ps(acc + i);
+                _mm256_storeu_ps(w + i, _mm256_fmadd_ps(d, vscale, _mm256_mul_ps(_mm256_loadu_ps(w + i), vkeep)));
+                _mm256_storeu_ps(acc + i, zero);
+            }
+#endif
+            for (; i < n; i++) {
+                w[i] = w[i] * keep + acc[i] * scale;
+                acc[i] = 0;
+            }
+            break;
+        }
+
+        case OptimizerKind::MOMENTUM: {
+#ifdef NN_OPT_AVX2
+            const __m256 vkeep = _mm256_set1_ps(keep), vlr = _mm256_set1_ps(lr), vmu = _mm256_set1_ps(s.momentum);
+            const __m256 vgs = _mm256_set1_ps(grad_scale), zero = _mm256_setzero_ps();
+            for (; i + 8 <= n; i += 8) {
+                const __m256 mi = _mm256_fmadd_ps(vmu, _mm256_loadu_ps(m + i), _mm256_mul_ps(_mm256_loadu_ps(acc + i), vgs));
+                _mm256_storeu_ps(m + i, mi);
+                _mm256_storeu_ps(w + i, _mm256_fmadd_ps(mi, vlr, _mm256_mul_ps(_mm256_loadu_ps(w + i), vkeep)));
+                _mm256_storeu_ps(acc + i, zero);
+            }
+#endif
+            for (; i < n; i++) {
+                m[i] = s.momentum * m[i] + acc[i] * grad_scale;
+                w[i] = w[i] * keep + lr * m[i];
+                acc[i] = 0;
+            }
+            break;
+        }
+
+        case OptimizerKind::ADAM: {
+            const float b1 = s.beta1, b2 = s.beta2, step = lr * s.correct1;
+#ifdef NN_OPT_AVX2
+            const __m256 vkeep = _mm256_set1_ps(keep), vstep = _mm256_set1_ps(step), vgs = _mm256_set1_ps(grad_scale);
+            const __m256 vb1 = _mm256_set1_ps(b1), vb1c = _mm256_set1_ps(1 - b1);
+            const __m256 vb2 = _mm256_set1_ps(b2), vb2c = _mm256_set1_ps(1 - b2);
+            const __m256 vc2 = _mm256_set1_ps(s.correct2), veps = _mm256_set1_ps(s.eps), zero = _mm256_setzero_ps();
+            for (; i + 8 <= n; i += 8) {
+                const __m256 d = _mm256_mul_ps(_mm256_loadu_ps(acc + i), vgs);
+                const __m256 mi = _mm256_fmadd_ps(vb1, _mm256_loadu_ps(m + i), _mm256_mul_ps(vb1c, d));
+                const __m256 vi = _mm256_fmadd_ps(vb2, _mm256_loadu_ps(v + i), _mm256_mul_ps(vb2c, _mm256_mul_ps(d, d)));
+                const __m256 denom = _mm256_add_ps(_mm256_sqrt_ps(_mm256_mul_ps(vi, vc2)), veps);
+                const __m256 upd = _mm256_div_ps(_mm256_mul_ps(mi, vstep), denom);
+
+                _mm256_storeu_ps(m + i, mi);
+                _mm256_storeu_ps(v + i, vi);
+                _mm256_storeu_ps(w + i, _mm256_fmadd_ps(_mm256_loadu_ps(w + i), vkeep, upd));
+                _mm256_storeu_ps(acc + i, zero);
+            }
+#endif
+            for (; i < n; i++) {
+                const float d = acc[i] * grad_scale;
+                m[i] = b1 * m[i] + (1 - b1) * d;
+                v[i] = b2 * v[i] + (1 - b2) * d * d;
+                w[i] = w[i] * keep + step * m[i] / (std::sqrt(v[i] * s.correct2) + s.eps);
+                acc[i] = 0;
+            }
+            break;
+        }
+    }
+}
+
+// Multiplier of the learning rate at a given step (the number of apply_backprop() calls before it)
+using LearnSchedule = std::function<double(std::uint64_t step)>;
+
+inline LearnSchedule constant_schedule() {
+    return [](std::uint64_t) { return 1.0; };
+}
+
+// Linear warm-up over warmup steps, then a cosine decay to floor at total steps
+inline LearnSchedule warmup_cosine(std::uint64_t warmup, std::uint64_t total, double floor = 0.1) {
+    return [=](std::uint64_t step) {
+        if (step < warmup) return double(step + 1) / double(warmup);
+        const double progress = std::min(1.0, double(step - warmup) / double(total > warmup ? total - warmup : 1));
+        return floor + (1 - floor) * 0.5 * (1 + std::cos(std::numbers::pi * progress));
+    };
+}
+
+// Multiply by factor every `every` steps
+inline LearnSchedule step_decay(std::uint64_t every, double factor) {
+    return [=](std::uint64_t step) { return std::pow(factor, double(step / std::max<std::uint64_t>(every, 1))); };
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "nn_linalg.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NN_QUANT_AVX2
+#endif
+
+/**
+ * Integer inference layers, built from trained float layers, in the style of Stockfish's NNUE.
+ *
+ * Activations are sigmoid outputs in [0, 1] stored as uint8 in [0, QUANT_ACT_ONE]. Dense layers
+ * have int8 weights with one float scale per output row and multiply through maddubs/madd: with
+ * both operands capped at 127, a pair of products never saturates the int16 lanes of maddubs.
+ * The sparse first layer keeps int16 weights and sums the rows of the active inputs in int32.
+ * Biases and the final rescale stay float; they cost one multiply-add per output.
+ */
+
+constexpr int QUANT_ACT_ONE = 127;
+constexpr int QUANT_WEIGHT_MAX = 127;
+
+// Dense inputs are padded with zeros to whole 32 byte vectors
+constexpr int quant_padded(int n) {
+    return (n + 31) / 32 * 32;
+}
+
+inline std::uint8_t quantize_activation(float a) {
+    return std::uint8_t(std::lround(std::clamp(a, 0.0f, 1.0f) * QUANT_ACT_ONE));
+}
+
+#ifdef NN_QUANT_AVX2
+inline __m256i quant_dot32(__m256i acc, __m256i in, const std::int8_t *w) {
+    const __m256i prod = _mm256_maddubs_epi16(in, _mm256_loadu_si256((const __m256i *) w));
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(prod, _mm256_set1_epi16(1)));
+}
+
+inline std::int32_t quant_hsum(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+#endif
+
+/**
+ * emit(i, dot) for every row i of the rows x cols int8 matrix w, where dot is the int32 dot product
+ * of row i with in. cols must be a multiple of 32. Four rows are done at once to reuse each load of in.
+ */
+template <typename Emit>
+inline void quant_affine(const std::uint8_t *in, const std::int8_t *w, int rows, int cols, Emit &&emit) {
+    int i = 0;
+#ifdef NN_QUANT_AVX2
+    for (; i + 4 <= rows; i += 4) {
+        const std::int8_t *w0 = w + std::size_t(i) * cols;
+        __m256i a0 = _mm256_setzero_si256(), a1 = a0, a2 = a0, a3 = a0;
+        for (int k = 0; k < cols; k += 32) {
+            const __m256i x = _mm256_loadu_si256((const __m256i *) (in + k));
+            a0 = quant_dot32(a0, x, w0 + k);
+            a1 = quant_dot32(a1, x, w0 + cols + k);
+            a2 = quant_dot32(a2, x, w0 + 2 * cols + k);
+            a3 = quant_dot32(a3, x, w0 + 3 * cols + k);
+        }
+        emit(i, quant_hsum(a0));
+        emit(i + 1, quant_hsum(a1));
+        emit(i + 2, quant_hsum(a2));
+        emit(i + 3, quant_hsum(a3));
+    }
+#endif
+    for (; i < rows; i++) {
+        const std::int8_t *row = w + std::size_t(i) * cols;
+        std::int32_t dot = 0;
+        for (int k = 0; k < cols; k++)
+            dot += std::int32_t(in[k]) * row[k];
+        emit(i, dot);
+    }
+}
+
+// Fully connected layer with int8 weights, quantized from a trained Layer
+template <int InpNo, int OutNo, typename Activation = SigmoidActivation<NumericT>>
+class QuantLayer {
+public:
+    constexpr static int padded_inputs = quant_padded(InpNo);
+    constexpr static int padded_outputs = quant_padded(OutNo);
+
+    std::vector<std::int8_t> weights = std::vector<std::int8_t>(std::size_t(OutNo) * padded_inputs);
+    std::vector<float> scales = std::vector<float>(OutNo);
+    std::vector<float> biases = std::vector<float>(OutNo);
+
+    template <typename FloatLayer>
+    void quantize(const FloatLayer &layer) {
+        for (int i = 0; i < OutNo; i++) {
+            NumericT max_abs = 0;
+            for (int j = 0; j < InpNo; j++)
+                max_abs = std::max(max_abs, std::abs(layer.weights[i][j]));
+
+            const float scale = max_abs > 0 ? float(max_abs) / QUANT_WEIGHT_MAX : 1;
+            for (int j = 0; j < InpNo; j++)
+                weights[std::size_t(i) * padded_inputs + j] = std::int8_t(std::lround(layer.weights[i][j] / scale));
+
+            scales[i] = scale / QUANT_ACT_ONE;
+            biases[i] = float(layer.biases[i][0]);
+        }
+    }
+
+    // Pre-activations of in, which holds padded_inputs activations
+    inline void forward(const std::uint8_t *in, float *z) const {
+        quant_affine(in, weights.data(), OutNo, padded_inputs, [&](int i, std::int32_t dot) {
+            z[i] = float(dot) * scales[i] + biases[i];
+        });
+    }
+
+    // Quantized activations of in; out must hold padded_outputs entries, the padding is zeroed
+    inline void forward(const std::uint8_t *in, std::uint8_t *out) const {
+        quant_affine(in, weights.data(), OutNo, padded_inputs, [&](int i, std::int32_t dot) {
+            out[i] = quantize_activation(Activation::activate(float(dot) * scales[i] + biases[i]));
+        });
+        std::fill(out + OutNo, out + padded_outputs, 0);
+    }
+};
+
+// Sparse first layer with int16 weights, quantized from a trained SparseLayer
+template <typename Input, int OutNo, typename Activation = SigmoidActivation<NumericT>>
+class QuantSparseLayer {
+public:
+    constexpr static int InpNo = Input::inputs;
+    constexpr static int padded_outputs = quant_padded(OutNo);
+
+    // Input-major like SparseLayer; the dense tail stays float since its input is not one-hot
+    std::vector<std::int16_t> weights = std::vector<std::int16_t>(std::size_t(Input::dense_begin) * padded_outputs);
+    std::vector<float> dense_weights = std::vector<float>(std::size_t(Input::dense_no) * OutNo);
+    std::vector<float> biases = std::vector<float>(OutNo);
+    float scale = 1;
+
+    template <typename FloatLayer>
+    void quantize(const FloatLayer &layer) {
+        NumericT max_abs = 0;
+        for (int j = 0; j < Input::dense_begin; j++)
+            for (int i = 0; i < OutNo; i++)
+                max_abs = std::max(max_abs, std::abs(layer.weights[j][i]));
+
+        scale = max_abs > 0 ? float(max_abs) / INT16_MAX : 1;
+        for (int j = 0; j < Input::dense_begin; j++)
+            for (int i = 0; i < OutNo; i++)
+                weights[std::size_t(j) * padded_outputs + i] = std::int16_t(std::lround(layer.weights[j][i] / scale));
+
+        for (int d = 0; d < Input::dense_no; d++)
+            for (int i = 0; i < OutNo; i++)
+                dense_weights[std::size_t(d) * OutNo + i] = float(layer.weights[Input::dense_begin + d][i]);
+
+        for (int i = 0; i < OutNo; i++)
+            biases[i] = float(layer.biases[i][0]);
+    }
+
+    // Quantized activations of in; out must hold padded_outputs entries, the padding is zeroed
+    inline void forward(const Input &in, std::uint8_t *out) const {
+        alignas(32) std::int32_t acc[padded_outputs]{};
+        for (int a = 0; a < in.count; a++) {
+            const std::int16_t *row = weights.data() + std::size_t(in.idx[a]) * padded_outputs;
+            for (int i = 0; i < padded_outputs; i++)
+                acc[i] += row[i];
+        }
+
+        float z[OutNo];
+        for (int i = 0; i < OutNo; i++) {
+            z[i] = float(acc[i]) * scale + biases[i];
+            for (int d = 0; d < Input::dense_no; d++)
+                z[i] += dense_weights[std::size_t(d) * OutNo + i] * float(in.dense[d]);
+        }
+
+        Activation::activate_n(z, z, OutNo);
+        for (int i = 0; i < OutNo; i++)
+            out[i] = quantize_activation(z[i]);
+        std::fill(out + OutNo, out + padded_outputs, 0);
+    }
+};
@@ -0,0 +1,128 @@
+#include "puzzle_index.hpp"
+
+#include "traindata.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <iostream>
+
+namespace {
+constexpr std::uint16_t NO_OPENING = UINT16_MAX;
+
+// Calls fn for every space separated word of s
+template <typename F>
+void for_each_word(std::string_view s, F &&fn) {
+    std::size_t pos = 0;
+    while (pos < s.size()) {
+        const std::size_t end = std::min(s.find(' ', pos), s.size());
+        if (end > pos)
+            fn(s.substr(pos, end - pos));
+        pos = end + 1;
+    }
+}
+}
+
+void PuzzleIndex::build(const PuzzleTable &table) {
+    const std::size_t n = table.size();
+    masks.assign(n, {});
+    ratings.assign(n, 0);
+    openings.assign(n, NO_OPENING);
+    by_theme.clear();
+    by_opening.clear();
+    theme_ids.clear();
+    opening_ids.clear();
+    theme_names.clear();
+
+    std::size_t dropped = 0;
+    for (std::uint32_t row = 0; row < n; row++) {
+        for_each_word(table.get(row, PUZZLE_THEMES), [&](std::string_view theme) {
+            auto it = theme_ids.find(theme);
+            if (it == theme_ids.end()) {
+                if (theme_names.size() == MAX_THEMES) {
+                    dropped++;
+                    return;
+                }
+                it = theme_ids.emplace(std::string(theme), int(theme_names.size())).first;
+                theme_names.emplace_back(theme);
+                by_theme.emplace_back();
+            }
+            masks[row].set(it->second);
+            by_theme[it->second].push_back(row);
+        });
+
+        const std::string_view rating = table.get(row, PUZZLE_RATING);
+        std::from_chars(rating.data(), rating.data() + rating.size(), ratings[row]);
+
+        // Newer dumps put "Family Family_Variation" in one column; the family is the first word
+        const std::string_view tags = table.get(row, PUZZLE_OPENING_FAMILY);
+        const std::string_view family = tags.substr(0, tags.find(' '));
+        if (!family.empty()) {
+            auto it = opening_ids.find(family);
+            if (it == opening_ids.end()) {
+                it = opening_ids.emplace(std::string(family), int(by_opening.size())).first;
+                by_opening.emplace_back();
+            }
+            openings[row] = std::uint16_t(it->second);
+            by_opening[it->second].push_back(row);
+        }
+    }
+
+    if (dropped > 0)
+        std::cerr << "More than " << MAX_THEMES << " puzzle themes, ignored " << dropped << " tags\n";
+}
+
+PuzzleSelection PuzzleIndex::select(const PuzzleQuery &q) const {
+    PuzzleSelection res;
+
+    ThemeMask all, any, none;
+    for (const auto &t: q.all_of) {
+        const int id = theme_id(t);
+        if (id < 0) return res; // nothing has a theme that never occurs
+        all.set(id);
+    }
+    for (const auto &t: q.any_of)
+        if (const int id = theme_id(t); id >= 0) any.set(id);
+    for (const auto &t: q.none_of)
+        if (const int id = theme_id(t); id >= 0) none.set(id);
+    if (!q.any_of.empty() && any.none())
+        return res;
+
+    std::vector<bool> opening_ok;
+    if (!q.openings.empty()) {
+        opening_ok.assign(by_opening.size(), false);
+        for (const auto &o: q.openings)
+            if (const int id = opening_id(o); id >= 0) opening_ok[id] = true;
+    }
+
+    auto matches = [&](std::uint32_t row) {
+        const ThemeMask &m = masks[row];
+        if ((m & all) != all || (any.any() && (m & any).none()) || (m & none).any())
+            return false;
+        if (ratings[row] < q.min_rating || ratings[row] > q.max_rating)
+            return false;
+        return opening_ok.empty() || (openings[row] != NO_OPENING && opening_ok[openings[row]]);
+    };
+
+    // Only the rarest required theme's puzzles can match
+    const std::vector<std::uint32_t> *candidates = nullptr;
+    for (std::size_t id = 0; id < by_theme.size(); id++)
+        if (all.test(id) && (!candidates || by_theme[id].size() < candidates->size()))
+            candidates = &by_theme[id];
+
+    if (candidates) {
+        for (const std::uint32_t row: *candidates)
+            if (matches(row)) res.rows.push_back(row);
+    } else if (!opening_ok.empty()) {
+        // Every puzzle has at most one opening, so the lists are disjoint
+        for (std::size_t id = 0; id < by_opening.size(); id++)
+            if (opening_ok[id])
+                for (const std::uint32_t row: by_opening[id])
+                    if (matches(row)) res.rows.push_back(row);
+        std::sort(res.rows.begin(), res.rows.end());
+    } else {
+        for (std::uint32_t row = 0; row < masks.size(); row++)
+            if (matches(row)) res.rows.push_back(row);
+    }
+
+    return res;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <bitset>
+#include <climits>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class PuzzleTable;
+
+// Lichess uses about 70 themes
+constexpr int MAX_THEMES = 128;
+using ThemeMask = std::bitset<MAX_THEMES>;
+
+// Puzzles must have every theme in all_of, at least one in any_of (if given) and none in none_of
+struct PuzzleQuery {
+    std::vector<std::string> all_of, any_of, none_of;
+    std::vector<std::string> openings; // opening families, any of them; empty allows all
+    int min_rating = 0, max_rating = INT_MAX;
+};
+
+// Rows matching a query; drawing one is O(1)
+struct PuzzleSelection {
+    std::vector<std::uint32_t> rows;
+
+    [[nodiscard]] bool empty() const { return rows.empty(); }
+    [[nodiscard]] std::size_t size() const { return rows.size(); }
+
+    template <typename Rng>
+    std::uint32_t sample(Rng &rng) const {
+        return rows[std::uniform_int_distribution<std::size_t>(0, rows.size() - 1)(rng)];
+    }
+};
+
+/**
+ * Themes, opening family and rating of every puzzle, tokenized once. Theme and opening names are
+ * interned to small ids; each puzzle gets a ThemeMask, and every theme and opening keeps the sorted
+ * list of its puzzles, so a query only scans the rows of its rarest required theme.
+ */
+class PuzzleIndex {
+public:
+    // Needs the THEMES column; RATING and OPENING_FAMILY are used when loaded
+    void build(const PuzzleTable &table);
+
+    [[nodiscard]] PuzzleSelection select(const PuzzleQuery &q) const;
+
+    // -1 for names that never occur
+    [[nodiscard]] int theme_id(std::string_view name) const { return find(theme_ids, name); }
+    [[nodiscard]] int opening_id(std::string_view name) const { return find(opening_ids, name); }
+
+    [[nodiscard]] std::size_t size() const { return masks.size(); }
+    [[nodiscard]] std::size_t num_themes() const { return theme_names.size(); }
+    [[nodiscard]] const std::string &theme_name(int id) const { return theme_names[id]; }
+    [[nodiscard]] std::size_t theme_count(int id) const { return by_theme[id].size(); }
+
+private:
+    struct NameHash {
+        using is_transparent = void;
+        std::size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+    };
+    using NameIds = std::unordered_map<std::string, int, NameHash, std::equal_to<>>;
+
+    NameIds theme_ids, opening_ids;
+    std::vector<std::string> theme_names;
+
+    std::vector<ThemeMask> masks;
+    std::vector<std::uint16_t> ratings;
+    std::vector<std::uint16_t> openings;
+    std::vector<std::vector<std::uint32_t>> by_theme, by_opening;
+
+    static int find(const NameIds &ids, std::string_view name) {
+        auto it = ids.find(name);
+        return it == ids.end() ? -1 : it->second;
+    }
+};
@@ -0,0 +1,67 @@
+#include "quantized_net.hpp"
+
+#include <iostream>
+
+QuantizedNetwork::QuantizedNetwork(const Network &net) {
+    hid1.quantize(net.hid1);
+    hid2.quantize(net.hid2);
+    hid3.quantize(net.hid3);
+    hid4.quantize(net.hid4);
+    out.quantize(net.out);
+}
+
+std::array<float, 2> QuantizedNetwork::evaluate(const BoardFeatures &in) const {
+    // The widest activation is L2_SIZE bytes, small enough for the stack
+    alignas(32) std::uint8_t a1[decltype(hid1)::padded_outputs];
+    alignas(32) std::uint8_t a2[decltype(hid2)::padded_outputs];
+    alignas(32) std::uint8_t a3[decltype(hid3)::padded_outputs];
+    alignas(32) std::uint8_t a4[decltype(hid4)::padded_outputs];
+
+    hid1.forward(in, a1);
+    hid2.forward(a1, a2);
+    hid3.forward(a2, a3);
+    hid4.forward(a3, a4);
+
+    float z[2];
+    out.forward(a4, z);
+    return {SigmoidActivation<NumericT>::activate(z[0]), SigmoidActivation<NumericT>::activate(z[1])};
+}
+
+QuantizationError check_quantization(Trainer &trainer, const QuantizedNetwork &q, const std::vector<std::string> &fens) {
+    QuantizationError res{};
+    res.samples = int(fens.size());
+    if (fens.empty()) return res;
+
+    Network &net = *trainer.net;
+    std::vector<BoardFeatures> samples(fens.size());
+    int agree = 0;
+    for (std::size_t s = 0; s < fens.size(); s++) {
+        trainer.position_fen(fens[s]);
+        encode_features(trainer.pos, samples[s]);
+
+        // pick_move() is the child train_line_here() plays, by the same rule; where that is
+        // MOVE_NONE the line ends and no move is played, so there is nothing to agree on
+        const Move expected = trainer.pick_move();
+        if (expected == MOVE_NONE) continue;
+        res.positions++;
+        agree += trainer.pick_move(q) == expected;
+    }
+    res.move_agreement = res.positions ? double(agree) / res.positions : 1;
+
+    std::vector<std::array<NumericT, 2>> expected(samples.size());
+    net.evaluate_batch(net.main_worker(), samples.data(), int(samples.size()), expected.data());
+    for (std::size_t s = 0; s < samples.size(); s++) {
+        const auto actual = q.evaluate(samples[s]);
+        for (int o = 0; o < 2; o++) {
+            const double err = std::abs(double(actual[o]) - expected[s][o]);
+            res.mean_abs += err;
+            res.max_abs = std::max(res.max_abs, err);
+        }
+    }
+    res.mean_abs /= 2.0 * samples.size();
+
+    std::cout << "QUANTIZATION: " << res.samples << " samples, mean abs err = " << res.mean_abs
+              << ", max abs err = " << res.max_abs << ", best move agreement = " << res.move_agreement << " over "
+              << res.positions << " positions\n";
+    return res;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "nn_quant.hpp"
+#include "trainer.hpp"
+
+/**
+ * Integer copy of a trained Network for ranking positions and fast playouts. It is a snapshot:
+ * rebuild it after the float network has been trained further.
+ */
+class QuantizedNetwork {
+public:
+    QuantSparseLayer<BoardFeatures, INP_SIZE> hid1;
+    QuantLayer<INP_SIZE, L2_SIZE> hid2;
+    QuantLayer<L2_SIZE, 512> hid3;
+    QuantLayer<512, 64> hid4;
+    QuantLayer<64, 2> out;
+
+    explicit QuantizedNetwork(const Network &net);
+
+    // [win %, loss %] of one position, like Network::forward()
+    [[nodiscard]] std::array<float, 2> evaluate(const BoardFeatures &in) const;
+};
+
+struct QuantizationError {
+    double mean_abs = 0; // mean absolute error of win % and loss %
+    double max_abs = 0;
+    double move_agreement = 0; // fraction of positions where q picks the child train_line_here() plays
+    int samples = 0;
+    int positions = 0; // samples train_line_here() plays on from; the rest end its line
+};
+
+// Compare q against trainer's float network on the given positions, both output by output and by
+// the child of each position that Trainer::pick_move() chooses
+QuantizationError check_quantization(Trainer &trainer, const QuantizedNetwork &q, const std::vector<std::string> &fens);
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <vector>
+
+constexpr int WDL_BUCKETS = 8;
+
+// Bucket of a label by win % - loss %, from 0 (certain loss) to buckets - 1 (certain win)
+inline int wdl_bucket(double win, double loss, int buckets = WDL_BUCKETS) {
+    const int b = int((win - loss + 1) / 2 * buckets);
+    return std::clamp(b, 0, buckets - 1);
+}
+
+enum class Stratify {
+    NONE,         // plain shuffle
+    PROPORTIONAL, // every stretch of the epoch has the bucket mix of the whole dataset
+    BALANCED,     // every bucket gets the same share of the epoch; small buckets repeat, large ones are cut
+};
+
+/**
+ * Visiting order of n samples, reshuffled every epoch in O(n) without touching the samples.
+ *
+ * With block > 1 the order is a shuffle of blocks of consecutive indices, each shuffled inside,
+ * so out-of-core data is read a block at a time. Stratified orders ignore block: each WDL bucket
+ * is shuffled on its own and the buckets are interleaved evenly.
+ */
+class EpochSampler {
+public:
+    explicit EpochSampler(std::size_t n, std::size_t block_size = 1)
+            : order(n), samples(n), block(std::max<std::size_t>(block_size, 1)) {
+        std::iota(order.begin(), order.end(), 0);
+    }
+
+    // bucket[i] in [0, buckets) is the stratum of sample i
+    void stratify(const std::vector<std::uint8_t> &bucket, int buckets, Stratify how) {
+        mode = how;
+        strata.assign(buckets, {});
+        for (std::uint32_t i = 0; i < bucket.size(); i++)
+            strata[bucket[i]].push_back(i);
+    }
+
+    [[nodiscard]] std::size_t size() const { return samples; }
+
+    // Order for the next epoch; valid until the next call
+    const std::vector<std::uint32_t> &next_epoch(std::mt19937_64 &rng) {
+        if (mode != Stratify::NONE)
+            interleave_strata(rng);
+        else if (block == 1)
+            std::shuffle(order.begin(), order.end(), rng);
+        else
+            shuffle_blocks(rng);
+        return order;
+    }
+
+private:
+    std::vector<std::uint32_t> order;
+    std::size_t samples; // balanced epochs can be a little shorter than this
+    std::size_t block;
+
+    Stratify mode = Stratify::NONE;
+    std::vector<std::vector<std::uint32_t>> strata;
+
+    void shuffle_blocks(std::mt19937_64 &rng) {
+        const std::size_t n = order.size(), blocks = (n + block - 1) / block;
+        std::vector<std::uint32_t> ids(blocks);
+        std::iota(ids.begin(), ids.end(), 0);
+        std::shuffle(ids.begin(), ids.end(), rng);
+
+        std::size_t out = 0;
+        for (std::uint32_t b : ids) {
+            const std::size_t first = b * block, last = std::min(n, first + block);
+            const auto begin = order.begin() + std::ptrdiff_t(out);
+            std::iota(begin, begin + std::ptrdiff_t(last - first), std::uint32_t(first));
+            std::shuffle(begin, begin + std::ptrdiff_t(last - first), rng);
+            out += last - first;
+        }
+    }
+
+    /**
+     * Take target[b] samples from every stratum b, cycling (and reshuffling) strata that run out,
+     * and interleave them so stratum b appears every size / target[b] samples: at each step the
+     * stratum whose next sample is due soonest goes next.
+     */
+    void interleave_strata(std::mt19937_64 &rng) {
+        const std::size_t n = samples;
+        int non_empty = 0;
+        for (auto &s : strata) {
+            std::shuffle(s.begin(), s.end(), rng);
+            non_empty += !s.empty();
+        }
+        if (non_empty == 0) return;
+
+        const std::size_t k = strata.size();
+        std::vector<std::size_t> target(k), taken(k, 0), next(k, 0);
+        std::vector<double> phase(k);
+        std::uniform_real_distribution<double> unit(0, 1);
+        for (std::size_t b = 0; b < k; b++) {
+            target[b] = strata[b].empty() ? 0
+                      : mode == Stratify::BALANCED ? n / non_empty : strata[b].size();
+            phase[b] = unit(rng);
+        }
+
+        order.clear();
+        while (true) {
+            std::size_t best = k;
+            double due = 0;
+            for (std::size_t b = 0; b < k; b++) {
+                if (taken[b] == target[b]) continue;
+                const double t = (double(taken[b]) + phase[b]) / double(target[b]);
+                if (best == k || t < due) {
+                    best = b;
+                    due = t;
+                }
+            }
+            if (best == k) break;
+
+            auto &s = strata[best];
+            if (next[best] == s.size()) {
+                std::shuffle(s.begin(), s.end(), rng);
+                next[best] = 0;
+            }
+            order.push_back(s[next[best]++]);
+            taken[best]++;
+        }
+    }
+};
@@ -0,0 +1,119 @@
+#include "shard.hpp"
+#include "atomic_file.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <utility>
+
+#include <unistd.h>
+
+namespace {
+constexpr std::size_t SHARD_WRITE_BUFFER = 4096; // records
+
+ShardHeader make_shard_header(std::uint64_t count) {
+    ShardHeader h{};
+    std::memcpy(h.magic, SHARD_MAGIC, sizeof(h.magic));
+    h.version = SHARD_VERSION;
+    h.record_bytes = sizeof(ShardRecord);
+    h.inputs = INP_SIZE;
+    h.max_active = MAX_ACTIVE_FEATURES;
+    h.count = count;
+    return h;
+}
+}
+
+ShardWriter::~ShardWriter() {
+    if (fd >= 0) {
+        ::close(fd);
+        ::unlink((path + ".tmp").c_str());
+    }
+}
+
+bool ShardWriter::open(const std::string &file) {
+    path = file;
+    count = 0;
+    failed = false;
+    buffer.clear();
+    buffer.reserve(SHARD_WRITE_BUFFER);
+
+    fd = open_temporary(path);
+    if (fd < 0) return false;
+
+    // The count is patched in by finish()
+    const ShardHeader h = make_shard_header(0);
+    failed = !write_all(fd, &h, sizeof(h));
+    return !failed;
+}
+
+bool ShardWriter::flush() {
+    if (!buffer.empty())
+        failed = failed || !write_all(fd, buffer.data(), buffer.size() * sizeof(ShardRecord));
+    buffer.clear();
+    return !failed;
+}
+
+bool ShardWriter::append(const ShardRecord &r) {
+    if (fd < 0 || failed) return false;
+
+    buffer.push_back(r);
+    count++;
+    return buffer.size() < SHARD_WRITE_BUFFER || flush();
+}
+
+bool ShardWriter::finish() {
+    if (fd < 0) return false;
+
+    const ShardHeader h = make_shard_header(count);
+    const bool ok = flush() && ::pwrite(fd, &h, sizeof(h), 0) == ssize_t(sizeof(h));
+    return commit_temporary(std::exchange(fd, -1), path, ok);
+}
+
+bool Shard::open(const std::string &path) {
+    records = nullptr;
+    count = 0;
+
+    if (!map.open(path)) {
+        std::cerr << "Cannot map " << path << '\n';
+        return false;
+    }
+
+    ShardHeader h{};
+    if (map.size() < sizeof(h)) {
+        std::cerr << path << ": too small for a shard header\n";
+        map.close();
+        return false;
+    }
+    std::memcpy(&h, map.data(), sizeof(h));
+
+    const char *problem = nullptr;
+    if (std::memcmp(h.magic, SHARD_MAGIC, sizeof(h.magic)) != 0)
+        problem = "not a training shard";
+    else if (h.version != SHARD_VERSION)
+        problem = "unsupported shard version";
+    else if (h.record_bytes != sizeof(ShardRecord))
+        problem = "record size mismatch";
+    else if (h.inputs != std::uint32_t(INP_SIZE) || h.max_active != std::uint32_t(MAX_ACTIVE_FEATURES))
+        problem = "written with a different feature encoding";
+    else if (map.size() != sizeof(h) + h.count * sizeof(ShardRecord))
+        problem = "size does not match the record count";
+
+    if (problem) {
+        std::cerr << path << ": " << problem << '\n';
+        map.close();
+        return false;
+    }
+
+    // A corrupt record would index past BoardFeatures or the input layer, so none get through
+    const auto *first = reinterpret_cast<const ShardRecord *>(map.data() + sizeof(h));
+    const auto *bad = std::find_if_not(first, first + h.count, valid_shard_record);
+    if (bad != first + h.count) {
+        std::cerr << path << ": record " << bad - first << " has out of range features\n";
+        map.close();
+        return false;
+    }
+
+    records = first;
+    count = h.count;
+    return true;
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "features.hpp"
+#include "mapped_file.hpp"
+#include "trainer.hpp"
+
+/**
+ * Training shard format (version 1):
+ *
+ * [ ShardHeader ][ ShardRecord ] * count
+ *
+ * Each record is one labeled position, already turned into BoardFeatures indices, so training
+ * reads records straight out of a mapping with no FEN parsing and no Position::set(). Records are
+ * fixed size, so record i is at a known offset and shards can be sampled at random.
+ */
+
+constexpr char SHARD_MAGIC[8] = {'N', 'N', 'S', 'C', 'S', 'H', 'D', '\0'};
+constexpr std::uint32_t SHARD_VERSION = 1;
+
+struct ShardHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t record_bytes;
+    std::uint32_t inputs;      // INP_SIZE of the encoder that wrote it
+    std::uint32_t max_active;  // MAX_ACTIVE_FEATURES of the encoder that wrote it
+    std::uint64_t count;
+    std::uint64_t reserved[4];
+};
+
+static_assert(BoardFeatures::dense_no == 1, "records carry exactly one dense input, the rule50 clock");
+
+struct ShardRecord {
+    std::uint16_t count;
+    std::uint16_t idx[MAX_ACTIVE_FEATURES];
+    float rule50;
+    float win, loss;
+    std::int32_t eval;
+    std::uint32_t depth; // search depth of the label, 0 if unknown
+};
+
+static_assert(sizeof(ShardHeader) == 64);
+static_assert(sizeof(ShardRecord) == 96);
+
+inline ShardRecord make_shard_record(const BoardFeatures &f, const StockfishEval &ev) {
+    ShardRecord r{};
+    r.count = f.count;
+    std::copy_n(f.idx, f.count, r.idx);
+    r.rule50 = float(f.dense[0]);
+    r.win = float(ev.win);
+    r.loss = float(ev.loss);
+    r.eval = std::int32_t(ev.eval);
+    r.depth = std::uint32_t(ev.depth);
+    return r;
+}
+
+// At most MAX_ACTIVE_FEATURES features, every one of them a sparse input of the network
+inline bool valid_shard_record(const ShardRecord &r) {
+    return r.count <= MAX_ACTIVE_FEATURES &&
+           std::all_of(r.idx, r.idx + r.count, [](std::uint16_t i) { return i < BoardFeatures::dense_begin; });
+}
+
+// Shard::open() has checked every record of a shard; the count is still clamped so a record from
+// anywhere else cannot overrun f
+inline void unpack_shard_record(const ShardRecord &r, BoardFeatures &f, std::array<NumericT, 2> &label) {
+    f.count = std::min<std::uint16_t>(r.count, MAX_ACTIVE_FEATURES);
+    std::copy_n(r.idx, f.count, f.idx);
+    f.dense[0] = r.rule50;
+    label = {NumericT(r.win), NumericT(r.loss)};
+}
+
+/**
+ * Writes a shard to path + ".tmp" and renames it into place on finish(), so readers never see a
+ * partial shard.
+ */
+class ShardWriter {
+public:
+    ShardWriter() = default;
+    ~ShardWriter();
+
+    ShardWriter(const ShardWriter &) = delete;
+    ShardWriter &operator=(const ShardWriter &) = delete;
+
+    bool open(const std::string &path);
+
+    bool append(const ShardRecord &r);
+
+    // Write the record count, fsync and rename over path; false (and no file) on any error
+    bool finish();
+
+    [[nodiscard]] std::uint64_t size() const { return count; }
+
+private:
+    std::string path;
+    int fd = -1;
+    std::uint64_t count = 0;
+    bool failed = false;
+    std::vector<ShardRecord> buffer;
+
+    bool flush();
+};
+
+/**
+ * Read-only mapping of a shard, validated on open.
+ */
+class Shard {
+public:
+    // Maps and validates path, header and records alike; on failure, explains why on std::cerr and returns false
+    bool open(const std::string &path);
+
+    [[nodiscard]] std::size_t size() const { return count; }
+    [[nodiscard]] const ShardRecord &operator[](std::size_t i) const { return records[i]; }
+    [[nodiscard]] const ShardRecord *begin() const { return records; }
+    [[nodiscard]] const ShardRecord *end() const { return records + count; }
+
+    void advise_sequential() const { map.advise_sequential(); }
+
+private:
+    MappedFile map;
+    const ShardRecord *records = nullptr;
+    std::size_t count = 0;
+};
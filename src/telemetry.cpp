@@ -0,0 +1,234 @@
+#include "telemetry.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+namespace telemetry {
+namespace {
+using Clock = std::chrono::steady_clock;
+
+constexpr int NUM_PHASES = int(Phase::COUNT), NUM_COUNTERS = int(Counter::COUNT);
+
+// Bin i counts calls that took [2^(i-1), 2^i) ns; the last one takes everything longer
+constexpr int HIST_BINS = 48;
+
+constexpr const char *PHASE_NAMES[NUM_PHASES] = {"encode", "forward", "backward", "search", "io", "checkpoint"};
+constexpr const char *COUNTER_NAMES[NUM_COUNTERS] = {"samples", "labels", "cache_misses", "dead_ends"};
+
+/**
+ * What one thread recorded since it started. Only the owning thread writes, so updates are a
+ * relaxed load and store instead of a locked add; the reporter may read a value one update stale.
+ */
+struct alignas(64) ThreadStats {
+    std::atomic<std::uint64_t> counters[NUM_COUNTERS]{};
+    std::atomic<std::uint64_t> calls[NUM_PHASES]{};
+    std::atomic<std::uint64_t> ns[NUM_PHASES]{};
+    std::atomic<std::uint64_t> hist[NUM_PHASES][HIST_BINS]{};
+    std::atomic<double> loss_sum{0};
+    std::atomic<std::uint64_t> loss_samples{0};
+};
+
+// Plain copy of the sum of every ThreadStats
+struct Totals {
+    std::uint64_t counters[NUM_COUNTERS]{};
+    std::uint64_t calls[NUM_PHASES]{};
+    std::uint64_t ns[NUM_PHASES]{};
+    std::uint64_t hist[NUM_PHASES][HIST_BINS]{};
+    double loss_sum = 0;
+    std::uint64_t loss_samples = 0;
+};
+
+template <typename T>
+void bump(std::atomic<T> &a, T n) {
+    a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+template <typename T>
+T peek(const std::atomic<T> &a) { return a.load(std::memory_order_relaxed); }
+
+// Blocks are never freed, so what a finished thread recorded still counts towards the totals
+std::mutex registry_mtx;
+std::vector<std::unique_ptr<ThreadStats>> registry;
+
+ThreadStats &local() {
+    thread_local ThreadStats *stats = [] {
+        std::unique_lock<std::mutex> lg(registry_mtx);
+        return registry.emplace_back(std::make_unique<ThreadStats>()).get();
+    }();
+    return *stats;
+}
+
+std::atomic<Verbosity> level{Verbosity::SUMMARY};
+
+// Reporter state, behind report_mtx
+std::mutex report_mtx;
+double interval = 10;
+std::string json_file;
+const Clock::time_point started = Clock::now();
+Clock::time_point last_report = started;
+Totals last;
+
+Totals collect() {
+    Totals t;
+    std::unique_lock<std::mutex> lg(registry_mtx);
+    for (const auto &s: registry) {
+        for (int c = 0; c < NUM_COUNTERS; c++)
+            t.counters[c] += peek(s->counters[c]);
+        for (int p = 0; p < NUM_PHASES; p++) {
+            t.calls[p] += peek(s->calls[p]);
+            t.ns[p] += peek(s->ns[p]);
+            for (int b = 0; b < HIST_BINS; b++)
+                t.hist[p][b] += peek(s->hist[p][b]);
+        }
+        t.loss_sum += peek(s->loss_sum);
+        t.loss_samples += peek(s->loss_samples);
+    }
+    return t;
+}
+
+Totals since(const Totals &now, const Totals &before) {
+    Totals d;
+    for (int c = 0; c < NUM_COUNTERS; c++)
+        d.counters[c] = now.counters[c] - before.counters[c];
+    for (int p = 0; p < NUM_PHASES; p++) {
+        d.calls[p] = now.calls[p] - before.calls[p];
+        d.ns[p] = now.ns[p] - before.ns[p];
+        for (int b = 0; b < HIST_BINS; b++)
+            d.hist[p][b] = now.hist[p][b] - before.hist[p][b];
+    }
+    d.loss_sum = now.loss_sum - before.loss_sum;
+    d.loss_samples = now.loss_samples - before.loss_samples;
+    return d;
+}
+
+// Upper bound in ns of the bin holding quantile q of phase p's calls
+double quantile_ns(const Totals &t, int p, double q) {
+    if (t.calls[p] == 0) return 0;
+
+    const auto target = std::uint64_t(q * double(t.calls[p]));
+    std::uint64_t seen = 0;
+    for (int b = 0; b < HIST_BINS; b++) {
+        seen += t.hist[p][b];
+        if (seen > target) return std::ldexp(1.0, b);
+    }
+    return std::ldexp(1.0, HIST_BINS);
+}
+
+std::string duration(double ns) {
+    std::ostringstream os;
+    os << std::setprecision(3);
+    if (ns < 1e3) os << ns << "ns";
+    else if (ns < 1e6) os << ns / 1e3 << "us";
+    else if (ns < 1e9) os << ns / 1e6 << "ms";
+    else os << ns / 1e9 << 's';
+    return os.str();
+}
+
+double loss_of(const Totals &d) {
+    return d.loss_samples ? d.loss_sum / double(d.loss_samples) : 0;
+}
+
+void print_line(const Totals &d, double sec) {
+    const auto samples = d.counters[int(Counter::SAMPLES)];
+    std::ostringstream os;
+    os << std::setprecision(4) << "stats " << sec << "s: " << double(samples) / sec << " samples/s, loss "
+       << loss_of(d);
+    for (int c = 1; c < NUM_COUNTERS; c++)
+        if (d.counters[c]) os << ", " << COUNTER_NAMES[c] << ' ' << d.counters[c];
+
+    for (int p = 0; p < NUM_PHASES; p++)
+        if (d.calls[p])
+            os << " | " << PHASE_NAMES[p] << ' ' << duration(double(d.ns[p])) << " p50 "
+               << duration(quantile_ns(d, p, 0.5)) << " p99 " << duration(quantile_ns(d, p, 0.99));
+
+    std::cout << os.str() << std::endl;
+}
+
+void write_json(const Totals &d, double sec, double at) {
+    std::ofstream fd{json_file, std::ios::app};
+    if (!fd) {
+        std::cerr << "Cannot write " << json_file << '\n';
+        return;
+    }
+
+    fd << std::setprecision(6) << "{\"time\":" << at << ",\"interval\":" << sec << ",\"samples_per_sec\":"
+       << double(d.counters[int(Counter::SAMPLES)]) / sec << ",\"loss\":" << loss_of(d) << ",\"counters\":{";
+    for (int c = 0; c < NUM_COUNTERS; c++)
+        fd << (c ? "," : "") << '"' << COUNTER_NAMES[c] << "\":" << d.counters[c];
+
+    fd << "},\"phases\":{";
+    for (int p = 0; p < NUM_PHASES; p++)
+        fd << (p ? "," : "") << '"' << PHASE_NAMES[p] << "\":{\"calls\":" << d.calls[p] << ",\"sec\":"
+           << double(d.ns[p]) / 1e9 << ",\"p50_us\":" << quantile_ns(d, p, 0.5) / 1e3 << ",\"p99_us\":"
+           << quantile_ns(d, p, 0.99) / 1e3 << '}';
+    fd << "}}\n";
+}
+
+// Caller holds report_mtx
+void report_locked(Clock::time_point now) {
+    const Totals totals = collect();
+    const Totals d = since(totals, last);
+    const double sec = std::max(std::chrono::duration<double>(now - last_report).count(), 1e-9);
+
+    if (level.load(std::memory_order_relaxed) != Verbosity::QUIET)
+        print_line(d, sec);
+    if (!json_file.empty())
+        write_json(d, sec, std::chrono::duration<double>(now - started).count());
+
+    last = totals;
+    last_report = now;
+}
+}
+
+void configure(Verbosity v, double interval_sec, const std::string &json_path) {
+    std::unique_lock<std::mutex> lg(report_mtx);
+    level.store(v, std::memory_order_relaxed);
+    interval = interval_sec;
+    json_file = json_path;
+}
+
+Verbosity verbosity() { return level.load(std::memory_order_relaxed); }
+
+void add(Counter c, std::uint64_t n) {
+    bump(local().counters[int(c)], n);
+}
+
+void record(Phase p, std::chrono::nanoseconds elapsed) {
+    ThreadStats &s = local();
+    const auto ns = std::uint64_t(std::max<std::int64_t>(elapsed.count(), 0));
+    bump(s.calls[int(p)], std::uint64_t(1));
+    bump(s.ns[int(p)], ns);
+    bump(s.hist[int(p)][std::min<int>(int(std::bit_width(ns)), HIST_BINS - 1)], std::uint64_t(1));
+}
+
+void add_loss(double sum, std::uint64_t n) {
+    ThreadStats &s = local();
+    bump(s.loss_sum, sum);
+    bump(s.loss_samples, n);
+}
+
+void maybe_report() {
+    const auto now = Clock::now();
+    std::unique_lock<std::mutex> lg(report_mtx, std::try_to_lock);
+    if (!lg.owns_lock() || std::chrono::duration<double>(now - last_report).count() < interval)
+        return;
+    if (level.load(std::memory_order_relaxed) == Verbosity::QUIET && json_file.empty())
+        return;
+
+    report_locked(now);
+}
+
+void report() {
+    std::unique_lock<std::mutex> lg(report_mtx);
+    report_locked(Clock::now());
+}
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/**
+ * Counters, per-phase timers and latency histograms for training and labeling, in place of a line
+ * of stdout per sample. Every thread accumulates into its own block with plain relaxed stores, so
+ * recording costs a clock read and a few adds; maybe_report() sums the blocks every interval and
+ * prints one stats line and/or appends one JSON object per line to a file.
+ */
+namespace telemetry {
+
+enum class Phase : int {
+    ENCODE,     // encode_features()
+    FORWARD,    // network forward passes, training and evaluation alike
+    BACKWARD,   // Network::backward()
+    SEARCH,     // one Stockfish search
+    IO,         // dataset loads, journal flushes
+    CHECKPOINT, // network copies and writes
+    COUNT
+};
+
+enum class Counter : int {
+    SAMPLES,      // trained on
+    LABELS,       // kept by the label generators
+    CACHE_MISSES, // train_this_position() had to search
+    DEAD_ENDS,    // positions train_line_here() could not continue from
+    COUNT
+};
+
+enum class Verbosity {
+    QUIET,   // no stats lines; the JSON file, if any, is still written
+    SUMMARY, // a stats line every interval
+    VERBOSE, // also the old per-sample and per-move lines
+};
+
+// Applies to every thread; json_path empty for no JSON output
+void configure(Verbosity v, double interval_sec = 10, const std::string &json_path = "");
+
+[[nodiscard]] Verbosity verbosity();
+[[nodiscard]] inline bool verbose() { return verbosity() == Verbosity::VERBOSE; }
+
+void add(Counter c, std::uint64_t n = 1);
+
+void record(Phase p, std::chrono::nanoseconds elapsed);
+
+// Sum of squared errors over n samples
+void add_loss(double sum, std::uint64_t n);
+
+// Times its scope as one call of a phase
+class ScopedPhase {
+public:
+    explicit ScopedPhase(Phase p) : phase(p), start(std::chrono::steady_clock::now()) {}
+    ~ScopedPhase() { record(phase, std::chrono::steady_clock::now() - start); }
+
+    ScopedPhase(const ScopedPhase &) = delete;
+    ScopedPhase &operator=(const ScopedPhase &) = delete;
+
+private:
+    Phase phase;
+    std::chrono::steady_clock::time_point start;
+};
+
+// report() if the interval has passed since the last one; a clock read otherwise
+void maybe_report();
+
+// Print and/or write everything recorded since the last report
+void report();
+}
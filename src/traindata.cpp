@@ -1,81 +1,222 @@
 #include "traindata.hpp"
 
-#include <fstream>
+#include "mapped_file.hpp"
+#include "telemetry.hpp"
+
+#include <cctype>
+#include <cstring>
 #include <iostream>
+#include <thread>
 // 5rk1/1p3ppp/pq3b2/8/8/1P1Q1N2/P4PPP/3R2K1 w - - 2 27
-std::vector<Puzzle> load_puzzles_csv(const std::string &file) {
-    std::vector<Puzzle> ret;
-
-    std::ifstream fd(file);
-
-    for (std::string line; std::getline(fd, line); ) {
-        ret.emplace_back();
+void PuzzleTable::parse_chunk(std::size_t begin, std::size_t end, std::vector<std::uint64_t> &out,
+                              std::size_t &bad) const {
+    const std::string_view data = map.view();
+    std::size_t pos = begin;
+    while (pos < end) {
+        const char *nl = static_cast<const char *>(std::memchr(data.data() + pos, '\n', end - pos));
+        std::size_t line_end = nl ? std::size_t(nl - data.data()) : end;
+        const std::size_t next = line_end + 1;
+        if (line_end > pos && data[line_end - 1] == '\r')
+            line_end--;
+
+        const std::string_view line = data.substr(pos, line_end - pos);
+        if (line.empty() || line.starts_with("PuzzleId,")) {
+            pos = next;
+            continue;
+        }
 
-        std::size_t index = 0;
-        std::size_t prev = 0;
-        std::size_t comma = line.find(',');
-        while (comma != std::string::npos) {
-            ret.back()[index++] = line.substr(prev, comma - prev);
+        const std::size_t first = out.size();
+        int index = 0;
+        bool ok = true;
+        std::size_t prev = pos;
+        while (true) {
+            const auto comma = line.find(',', prev - pos);
+            const std::size_t field_end = comma == std::string_view::npos ? line_end : pos + comma;
+
+            if (index < PUZZLE_COLUMNS && slot[index] >= 0) {
+                ok &= field_end - prev < (1u << LEN_BITS);
+                out.push_back(std::uint64_t(prev) << LEN_BITS | (field_end - prev));
+            }
+            index++;
+
+            if (comma == std::string_view::npos) break;
+            prev = field_end + 1;
+        }
 
-            prev = comma + 1;
-            comma = line.find(',', prev);
+        // Older dumps have two opening columns, newer ones a single OpeningTags
+        if (!ok || (index != 11 && index != 10)) {
+            out.resize(first);
+            bad++;
+        } else {
+            // Columns past the end of a 10-column row are empty
+            while (out.size() - first < columns)
+                out.push_back(std::uint64_t(line_end) << LEN_BITS);
         }
 
-        ret.back()[index++] = line.substr(prev);
+        pos = next;
+    }
+}
+
+bool PuzzleTable::load(const std::string &file, std::uint32_t mask, int threads) {
+    fields.clear();
+    rows = columns = 0;
+    for (int c = 0; c < PUZZLE_COLUMNS; c++)
+        slot[c] = mask & column_mask(PuzzleColumn(c)) ? int(columns++) : -1;
 
-        if (index != 11 && index != 10) {
-            std::cerr << "Invalid line: index = " << index << '\n';
-            ret.pop_back();
-        }
+    if (!map.open(file)) {
+        std::cerr << "Cannot map " << file << '\n';
+        return false;
+    }
+    map.advise_sequential();
+
+    const std::string_view data = map.view();
+    if (threads <= 0)
+        threads = int(std::max(1u, std::thread::hardware_concurrency()));
+
+    // Chunks start right after a newline so no row is split between threads
+    std::vector<std::size_t> bounds{0};
+    for (int t = 1; t < threads; t++) {
+        std::size_t b = std::max(bounds.back(), data.size() * t / threads);
+        const std::size_t nl = data.find('\n', b);
+        b = nl == std::string_view::npos ? data.size() : nl + 1;
+        if (b > bounds.back() && b < data.size())
+            bounds.push_back(b);
+    }
+    bounds.push_back(data.size());
+
+    const std::size_t chunks = bounds.size() - 1;
+    std::vector<std::vector<std::uint64_t>> parts(chunks);
+    std::vector<std::size_t> bad(chunks, 0);
+    std::vector<std::thread> workers;
+    for (std::size_t i = 0; i < chunks; i++)
+        workers.emplace_back([&, i] {
+            parts[i].reserve((bounds[i + 1] - bounds[i]) / 128 * columns);
+            parse_chunk(bounds[i], bounds[i + 1], parts[i], bad[i]);
+        });
+    for (auto &w: workers)
+        w.join();
+
+    std::size_t total = 0, invalid = 0;
+    for (std::size_t i = 0; i < chunks; i++) {
+        total += parts[i].size();
+        invalid += bad[i];
     }
 
-    fd.close();
+    fields.reserve(total);
+    for (auto &p: parts) {
+        fields.insert(fields.end(), p.begin(), p.end());
+        std::vector<std::uint64_t>().swap(p);
+    }
+    rows = columns ? total / columns : 0;
 
-    return ret;
+    if (invalid > 0)
+        std::cerr << "Skipped " << invalid << " invalid lines in " << file << '\n';
+    return true;
 }
 
-
-Dataset::Dataset() : dataset(load_puzzles_csv("/home/shared/chess/lichess_db_puzzle.csv")),
-                     dist(0, dataset.size() - 1) {}
+bool Dataset::load_puzzles(const std::string &file) {
+    const std::uint32_t columns = DEFAULT_PUZZLE_COLUMNS | column_mask(PUZZLE_RATING) |
+                                  column_mask(PUZZLE_OPENING_FAMILY);
+    if (!dataset.load(file, columns) || dataset.empty())
+        return false;
+    puzzles.build(dataset);
+    return true;
+}
 
 void Dataset::load_from_bin(const std::string &file) {
-    std::ifstream fd(file, std::ios::in | std::ios::binary);
-    while (!fd.eof()) {
-        StockfishEval ev{};
-        char c;
+    telemetry::ScopedPhase timer{telemetry::Phase::IO};
+    MappedFile map{file};
+    map.advise_sequential();
 
-        fd >> c;
-        if (c != 'N') {
+    auto load = [&](std::string_view fen, const StockfishEval &ev) {
+        add(std::string(fen), ev);
+        med.emplace_back(ev.eval);
+    };
+
+    const JournalScan scan = scan_journal(map.view(), load);
+    journal_bytes = scan.valid_bytes;
+    if (scan.is_journal || !map.is_open())
+        return;
+
+    // Files from before the journal: 'N' fen ',' raw StockfishEval (without depth), repeated
+    struct LegacyEval {
+        double win, loss;
+        Value eval;
+    };
+
+    const std::string_view data = map.view();
+    std::size_t pos = 0;
+    while (true) {
+        while (pos < data.size() && std::isspace((unsigned char) data[pos]))
+            pos++;
+        if (pos == data.size())
+            break;
+
+        const std::size_t comma = data.find(',', pos + 1);
+        if (data[pos] != 'N' || comma == std::string_view::npos || comma + 1 + sizeof(LegacyEval) > data.size()) {
             std::cerr << "corrupt N\n";
-            continue;
+            break;
         }
 
-        std::string fen;
+        LegacyEval raw{};
+        std::memcpy(&raw, data.data() + comma + 1, sizeof(LegacyEval));
+        load(data.substr(pos + 1, comma - pos - 1), StockfishEval{raw.win, raw.loss, raw.eval});
+        pos = comma + 1 + sizeof(LegacyEval);
+    }
+}
+
+std::uint64_t Dataset::save_to_bin(const std::string &file) const {
+    return write_journal(file, gen);
+}
+
+bool Dataset::open_journal(LabelJournal &journal, const std::string &file) {
+    if (journal_bytes == 0 && !gen.empty())
+        journal_bytes = save_to_bin(file);
+    return journal.open(file, journal_bytes);
+}
 
-        c = (char) fd.get();
-        do {
-            fen += c;
-            c = (char) fd.get();
-        } while (c != ',');
+void Dataset::add(const std::string &fen, const StockfishEval &ev) {
+    auto [it, inserted] = gen.try_emplace(fen, ev);
+    if (!inserted) {
+        // Replace the old label's contribution to the averages
+        accum -= it->second.eval;
+        accum_w -= it->second.win;
+        accum_l -= it->second.loss;
+        avg_divisor--;
+        it->second = ev;
+    }
 
-        fd.read((char *) &ev, sizeof(StockfishEval));
+    accum += ev.eval;
+    accum_w += ev.win;
+    accum_l += ev.loss;
+    avg_divisor++;
+}
 
-        gen[fen] = ev;
+void Dataset::add(const std::string &fen, const StockfishEval &ev, Key key) {
+    add(fen, ev);
+    evals.insert(key, ev);
+}
 
-        accum += ev.eval;
-        accum_w += ev.win;
-        accum_l += ev.loss;
-        avg_divisor++;
-        med.emplace_back(ev.eval);
+void Dataset::index_evals(const std::string &cache_file) {
+    if (evals.load(cache_file, journal_bytes) && evals.size() == gen.size()) {
+        std::cout << "Loaded " << evals.size() << " position keys from " << cache_file << '\n';
+        return;
     }
 
-    fd.close();
+    evals.clear();
+    evals.reserve(gen.size());
+    for (const auto &[fen, ev]: gen)
+        evals.insert(fen_key(fen), ev);
+
+    std::cout << "Indexed " << evals.size() << " position keys in " << evals.memory_bytes() / (1 << 20) << " MiB\n";
+    if (journal_bytes > 0)
+        evals.save(cache_file, journal_bytes);
 }
 
 void Dataset::print() {
     std::sort(med.begin(), med.end());
 
-    std::cout << "No. Puzzles = " << dataset.size() << '\n';
+    std::cout << "No. Puzzles = " << dataset.size() << " with " << puzzles.num_themes() << " themes\n";
     std::cout << "Loaded " << gen.size() << " positions from previous runs\n";
     std::cout << "Average eval: " << accum / avg_divisor << '\n';
 
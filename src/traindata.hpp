@@ -1,35 +1,120 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "eval_cache.hpp"
+#include "journal.hpp"
+#include "mapped_file.hpp"
+#include "puzzle_index.hpp"
 #include "trainer.hpp"
 
+constexpr const char *DEFAULT_PUZZLE_CSV = "/home/shared/chess/lichess_db_puzzle.csv";
+
+// Columns of the Lichess puzzle CSV, in file order
+enum PuzzleColumn {
+    PUZZLE_ID, PUZZLE_FEN, PUZZLE_MOVES, PUZZLE_RATING, PUZZLE_RATING_DEV, PUZZLE_POPULARITY, PUZZLE_NB_PLAYS,
+    PUZZLE_THEMES, PUZZLE_GAME_URL, PUZZLE_OPENING_FAMILY, PUZZLE_OPENING_VARIATION, PUZZLE_COLUMNS
+};
+
+constexpr std::uint32_t column_mask(PuzzleColumn c) { return 1u << c; }
+
+constexpr std::uint32_t DEFAULT_PUZZLE_COLUMNS =
+        column_mask(PUZZLE_FEN) | column_mask(PUZZLE_MOVES) | column_mask(PUZZLE_THEMES);
+
+// Views into a PuzzleTable's mapping; columns that were not loaded are empty
 struct Puzzle {
-    std::string Id,FEN,Moves,Rating,RatingDev,Popularity,NbPlays,Themes,GameUrl,OpeningFamily,OpeningVariation;
+    std::string_view Id,FEN,Moves,Rating,RatingDev,Popularity,NbPlays,Themes,GameUrl,OpeningFamily,OpeningVariation;
 
-    inline constexpr std::string &operator[](std::size_t i) { return (&Id)[i]; }
-    inline constexpr const std::string &operator[](std::size_t i) const { return (&Id)[i]; }
+    inline constexpr std::string_view &operator[](std::size_t i) { return (&Id)[i]; }
+    inline constexpr const std::string_view &operator[](std::size_t i) const { return (&Id)[i]; }
 };
 
-std::vector<Puzzle> load_puzzles_csv(const std::string &file);
+/**
+ * The puzzle CSV, memory-mapped and indexed without copying: every row keeps a packed
+ * (offset, length) per loaded column and nothing else, so the only memory besides the page cache
+ * is 8 bytes per row and column. Rows are split into chunks at line boundaries and parsed in parallel.
+ */
+class PuzzleTable {
+public:
+    PuzzleTable() = default;
+
+    // Index the columns in mask (see column_mask()); returns false if the file cannot be mapped
+    bool load(const std::string &file, std::uint32_t mask = DEFAULT_PUZZLE_COLUMNS, int threads = 0);
+
+    [[nodiscard]] std::size_t size() const { return rows; }
+    [[nodiscard]] bool empty() const { return rows == 0; }
+
+    // Field of a loaded column, empty if the column was not loaded
+    [[nodiscard]] std::string_view get(std::size_t row, PuzzleColumn c) const {
+        if (slot[c] < 0) return {};
+        const std::uint64_t f = fields[row * columns + slot[c]];
+        return map.view().substr(f >> LEN_BITS, f & ((1u << LEN_BITS) - 1));
+    }
+
+    [[nodiscard]] Puzzle operator[](std::size_t row) const {
+        Puzzle p{};
+        for (int c = 0; c < PUZZLE_COLUMNS; c++)
+            p[c] = get(row, PuzzleColumn(c));
+        return p;
+    }
+
+private:
+    // Fields are packed as offset << LEN_BITS | length
+    static constexpr int LEN_BITS = 16;
+
+    MappedFile map;
+    std::vector<std::uint64_t> fields;
+    std::array<int, PUZZLE_COLUMNS> slot{};
+    std::size_t columns = 0, rows = 0;
+
+    void parse_chunk(std::size_t begin, std::size_t end, std::vector<std::uint64_t> &out, std::size_t &bad) const;
+};
 
 struct Dataset {
     std::unordered_map<std::string, StockfishEval> gen;
 
+    // The labels of gen by label_key(), once index_evals() has run; what labeling checks against
+    EvalCache evals;
+
     std::vector<Value> med;
     std::int64_t accum = 0;
     std::int64_t avg_divisor = 1;
 
     double accum_w = 0, accum_l = 0;
 
-    std::vector<Puzzle> dataset;
-    std::uniform_int_distribution<std::size_t> dist;
+    // Intact length of the journal read by load_from_bin(), for LabelJournal::open(); 0 for older files
+    std::uint64_t journal_bytes = 0;
+
+    PuzzleTable dataset;
+    PuzzleIndex puzzles;
+
+    // Map and index the puzzle CSV that labeling draws from; training does not need it
+    bool load_puzzles(const std::string &file = DEFAULT_PUZZLE_CSV);
 
-    Dataset();
+    [[nodiscard]] PuzzleSelection select_puzzles(const PuzzleQuery &q) const { return puzzles.select(q); }
 
+    // Read a label journal, or a file in the format from before the journal, in one sequential pass
     void load_from_bin(const std::string &file);
 
+    // Atomically replace file with a compacted journal of every labeled position; returns its size, 0 on failure
+    std::uint64_t save_to_bin(const std::string &file) const;
+
+    // Open file for appending new labels, first rewriting it as a journal if it predates the format
+    bool open_journal(LabelJournal &journal, const std::string &file);
+
+    // Record a labeled position and its contribution to the running averages
+    void add(const std::string &fen, const StockfishEval &ev);
+
+    // Same, also entering the label in evals under the position's key
+    void add(const std::string &fen, const StockfishEval &ev, Key key);
+
+    // Fill evals from gen, reusing cache_file if it was saved for the same journal, and save it
+    void index_evals(const std::string &cache_file);
+
     void print();
 
     void mm_print();
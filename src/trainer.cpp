@@ -3,52 +3,317 @@
 //
 
 #include "trainer.hpp"
+#include "eval_cache.hpp"
+#include "quantized_net.hpp"
+#include "telemetry.hpp"
 
 #include "thread.h"
 #include "types.h"
 #include "timeman.h"
 #include "search.h"
 
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <utility>
 #include <sstream>
 
-static inline constexpr NumericT bb_bool_to_numeric(Bitboard bb) {
-    return bb != 0 ? 1.0 : 0.0;
+// Defined next to Search::Limits in search.cpp; set when the root position is in the tablebases
+namespace Stockfish::Tablebases {
+extern bool RootInTB;
+}
+
+NetFileHeader Network::file_header() const {
+    NetFileHeader h{};
+    std::memcpy(h.magic, NET_FILE_MAGIC, sizeof(h.magic));
+    h.version = NET_FILE_VERSION;
+    h.dtype = NetDType::F32;
+
+    h.layers[h.num_layers++] = {INP_SIZE, INP_SIZE, NetLayout::INPUT_MAJOR, 0};
+    h.layers[h.num_layers++] = {INP_SIZE, L2_SIZE, NetLayout::OUTPUT_MAJOR, 0};
+    h.layers[h.num_layers++] = {L2_SIZE, 512, NetLayout::OUTPUT_MAJOR, 0};
+    h.layers[h.num_layers++] = {512, 64, NetLayout::OUTPUT_MAJOR, 0};
+    h.layers[h.num_layers++] = {64, 2, NetLayout::OUTPUT_MAJOR, 0};
+
+    h.payload_bytes = arena.section_bytes(Arena::PARAMS);
+    return h;
+}
+
+OptimFileHeader Network::optim_header() const {
+    OptimFileHeader h{};
+    h.kind = std::uint32_t(optimizer.kind);
+    h.steps = steps;
+    h.slots = optimizer.slots();
+    h.slot_bytes = arena.section_bytes(Arena::PARAMS);
+    return h;
+}
+
+void Network::set_optimizer(const Optimizer &o) {
+    optimizer = o;
+    const std::size_t params = arena.section_bytes(Arena::PARAMS) / sizeof(NumericT);
+    moments.assign(params * o.slots(), 0);
+
+    // Every layer's moments sit at the same offset in their slot as its parameters in the arena
+    const auto *base = reinterpret_cast<const NumericT *>(arena.section(Arena::PARAMS));
+    auto bind = [&](auto &layer) {
+        for (int s = 0; s < OPTIM_SLOTS; s++) {
+            NumericT *slot = s < o.slots() ? moments.data() + s * params : nullptr;
+            layer.weight_moments[s].dat = slot ? slot + (layer.weights.dat - base) : nullptr;
+            layer.bias_moments[s].dat = slot ? slot + (layer.biases.dat - base) : nullptr;
+        }
+    };
+
+    bind(hid1);
+    bind(hid2);
+    bind(hid3);
+    bind(hid4);
+    bind(out);
 }
 
 void Network::save(const std::string &file) {
+    telemetry::ScopedPhase timer{telemetry::Phase::CHECKPOINT};
     std::cout << "SAVE\t";
-    std::ofstream fd{file, std::ios::out | std::ios::binary};
-    hid1.save(fd);
-    hid2.save(fd);
-    hid3.save(fd);
-    hid4.save(fd);
-    out.save(fd);
-    fd.close();
+
+    OptimFileHeader optim = optim_header();
+    if (write_net_file(file, file_header(), arena.section(Arena::PARAMS), arena.section_bytes(Arena::PARAMS),
+                       &optim.param_checksum) && optim.slots)
+        write_optim_file(optim_file_path(file), optim, reinterpret_cast<const std::byte *>(moments.data()),
+                         moments.size() * sizeof(NumericT));
+}
+
+bool Network::checkpoint(Checkpointer &cp) const {
+    telemetry::ScopedPhase timer{telemetry::Phase::CHECKPOINT};
+    const OptimFileHeader optim = optim_header();
+    return cp.request(file_header(), arena.section(Arena::PARAMS), arena.section_bytes(Arena::PARAMS),
+               optim.slots ? &optim : nullptr, reinterpret_cast<const std::byte *>(moments.data()));
 }
 
-void Network::load(const std::string &file) {
+bool Network::load_optimizer(const std::string &file, std::uint64_t param_checksum) {
+    const OptimFileHeader want = optim_header();
+    if (want.slots == 0) return true;
+
+    const std::string path = optim_file_path(file);
+    OptimFileHeader h{};
+    std::vector<std::byte> payload;
+    if (!std::filesystem::exists(path) || !read_optim_file(path, h, payload) || h.kind != want.kind ||
+        h.slots != want.slots || h.slot_bytes != want.slot_bytes || h.param_checksum != param_checksum) {
+        std::cerr << "No matching optimizer state for " << file << ", starting with fresh moments\n";
+        return false;
+    }
+
+    std::memcpy(moments.data(), payload.data(), payload.size());
+    steps = h.steps;
+    return true;
+}
+
+bool Network::load(const std::string &file) {
+    telemetry::ScopedPhase timer{telemetry::Phase::IO};
     std::cout << "LOAD\t";
+
+    char magic[sizeof(NET_FILE_MAGIC)]{};
     std::ifstream fd{file, std::ios::in | std::ios::binary};
+    if (!fd.read(magic, sizeof(magic))) {
+        std::cerr << "Cannot read " << file << ", keeping random weights\n";
+        return false;
+    }
+
+    if (std::memcmp(magic, NET_FILE_MAGIC, sizeof(magic)) != 0)
+        return load_legacy(fd, file);
+    fd.close();
+
+    NetFile nf;
+    if (!nf.open(file))
+        return false;
+
+    const NetFileHeader expected_header = file_header();
+    if (!same_shape(nf.header(), expected_header)) {
+        std::cerr << file << " was saved from a network of a different shape\n";
+        return false;
+    }
+
+    std::memcpy(arena.section(Arena::PARAMS), nf.payload(), expected_header.payload_bytes);
+    hid1.generation++;
+    hid2.sync_stored();
+    hid3.sync_stored();
+    hid4.sync_stored();
+    out.sync_stored();
+    load_optimizer(file, nf.header().checksum);
+    return true;
+}
+
+bool Network::load_legacy(std::ifstream &fd, const std::string &file) {
+    constexpr std::uintmax_t legacy_bytes = sizeof(NumericT) * (
+            (INP_SIZE + 1) * std::uintmax_t(INP_SIZE) + (INP_SIZE + 1) * std::uintmax_t(L2_SIZE) +
+            (L2_SIZE + 1) * std::uintmax_t(512) + (512 + 1) * 64 + (64 + 1) * 2);
+
+    std::error_code ec;
+    if (std::filesystem::file_size(file, ec) != legacy_bytes) {
+        std::cerr << file << " is neither a network file nor a headerless one of the right size\n";
+        return false;
+    }
+
+    fd.seekg(0);
     hid1.load(fd);
     hid2.load(fd);
     hid3.load(fd);
     hid4.load(fd);
     out.load(fd);
-    fd.close();
+    return bool(fd);
 }
 
-void Network::apply_backprop() {
-    std::cout << "EPOCH " << epoch++ << " DONE: " << num_samples << " samples, error = " << err / num_samples << '\n';
-    err = 0;
-    num_samples = 0;
+void Network::reduce_gradients(WorkerPool *pool) {
+    Worker &dst = main_worker();
+
+    // Workers that have not seen a sample since the last step only hold zeros
+    std::vector<Worker *> busy;
+    for (size_t w = 1; w < workers.size(); w++)
+        if (workers[w]->out_grads.num_backprops > 0)
+            busy.push_back(workers[w].get());
+    if (busy.empty()) return;
+
+    auto *sum = reinterpret_cast<NumericT *>(dst.arena.section(Arena::GRADS));
+    const size_t count = dst.arena.section_bytes(Arena::GRADS) / sizeof(NumericT);
+    constexpr size_t chunk = 1 << 16;
+
+    auto reduce = [&](int task, int) {
+        const size_t begin = task * chunk, end = std::min(count, begin + chunk);
+        for (Worker *w : busy) {
+            auto *src = reinterpret_cast<NumericT *>(w->arena.section(Arena::GRADS));
+            for (size_t i = begin; i < end; i++) {
+                sum[i] += src[i];
+                src[i] = 0;
+            }
+        }
+    };
+
+    const int tasks = int((count + chunk - 1) / chunk);
+    if (pool) pool->run(tasks, reduce);
+    else for (int t = 0; t < tasks; t++) reduce(t, 0);
 
-    hid1.apply_backprop();
-    hid2.apply_backprop();
-    hid3.apply_backprop();
-    hid4.apply_backprop();
-    out.apply_backprop();
+    for (Worker *w : busy) {
+        dst.hid1_grads.touched |= w->hid1_grads.touched;
+        w->hid1_grads.touched.reset();
 
-    save();
+        dst.hid1_grads.num_backprops += std::exchange(w->hid1_grads.num_backprops, 0);
+        dst.hid2_grads.num_backprops += std::exchange(w->hid2_grads.num_backprops, 0);
+        dst.hid3_grads.num_backprops += std::exchange(w->hid3_grads.num_backprops, 0);
+        dst.hid4_grads.num_backprops += std::exchange(w->hid4_grads.num_backprops, 0);
+        dst.out_grads.num_backprops += std::exchange(w->out_grads.num_backprops, 0);
+    }
+}
+
+void Network::apply_backprop(WorkerPool *pool) {
+    NumericT err = 0;
+    unsigned num_samples = 0;
+    for (auto &w : workers) {
+        err += std::exchange(w->err, 0);
+        num_samples += std::exchange(w->num_samples, 0);
+    }
+    // The running loss is reported by telemetry; this line is one per step
+    if (telemetry::verbose())
+        std::cout << "EPOCH " << epoch << " DONE: " << num_samples << " samples, error = " << err / num_samples << '\n';
+    epoch++;
+
+    reduce_gradients(pool);
+    Worker &w = main_worker();
+
+    const OptimStep s = OptimStep::of(optimizer, steps + 1, schedule(steps));
+    steps++;
+
+    // Only rows of touched inputs change, so the sparse layer is cheap enough to step serially
+    hid1.apply_backprop(w.hid1_grads, s);
+
+    auto apply_rows = [pool, &s](auto &layer, auto &grads) {
+        constexpr int rows = std::remove_reference_t<decltype(layer)>::outputs, chunk = 64;
+        auto step = [&](int task, int) {
+            layer.apply_backprop(grads, task * chunk, std::min(rows, (task + 1) * chunk), s);
+        };
+
+        const int tasks = (rows + chunk - 1) / chunk;
+        if (pool) pool->run(tasks, step);
+        else for (int t = 0; t < tasks; t++) step(t, 0);
+        grads.num_backprops = 0;
+    };
+
+    apply_rows(hid2, w.hid2_grads);
+    apply_rows(hid3, w.hid3_grads);
+    apply_rows(hid4, w.hid4_grads);
+    apply_rows(out, w.out_grads);
+}
+
+void Network::forward(Worker &w, int n) {
+    telemetry::ScopedPhase timer{telemetry::Phase::FORWARD};
+    hid1.forward(w.hid1, n);
+    forward_hidden(w, n);
+}
+
+void Network::forward_hidden(Worker &w, int n) {
+    hid2.forward(w.hid2, n);
+    hid3.forward(w.hid3, n);
+    hid4.forward(w.hid4, n);
+    out.forward(w.out, n);
+}
+
+void Network::backward(Worker &w, int n) {
+    telemetry::ScopedPhase timer{telemetry::Phase::BACKWARD};
+    out.init_backwards(w.out, w.expected, w.dCost_dOut, n);
+    const auto &dOut = out.backward(w.out, w.out_grads, w.dCost_dOut, n);
+    const auto &dHid4 = hid4.backward(w.hid4, w.hid4_grads, dOut, n);
+    const auto &dHid3 = hid3.backward(w.hid3, w.hid3_grads, dHid4, n);
+    hid1.backward(w.hid1, w.hid1_grads, hid2.backward(w.hid2, w.hid2_grads, dHid3, n), n);
+
+    NumericT err = 0;
+    for (int b = 0; b < n; b++)
+        err += std::pow(w.expected[0][b] - w.out.activation[0][b], 2) +
+               std::pow(w.expected[1][b] - w.out.activation[1][b], 2);
+
+    w.err += err;
+    w.num_samples += n;
+    telemetry::add(telemetry::Counter::SAMPLES, n);
+    telemetry::add_loss(err, n);
+}
+
+void Network::train(const BoardFeatures *inputs, const std::array<NumericT, 2> *labels, int n, WorkerPool *pool,
+                    std::array<NumericT, 2> *outputs) {
+    // One contiguous share of the batch per thread, each with a Worker of its own, so a small batch
+    // never allocates gradient buffers for threads that would get nothing to do
+    const int parts = std::min(pool ? pool->size() : 1, n);
+    while (int(workers.size()) < parts)
+        workers.emplace_back(std::make_unique<Worker>());
+
+    auto part = [&](int task, int) {
+        Worker &w = *workers[task];
+        const int end = int(std::int64_t(task + 1) * n / parts);
+        for (int first = int(std::int64_t(task) * n / parts); first < end; first += MAX_BATCH) {
+            const int count = std::min(MAX_BATCH, end - first);
+
+            for (int b = 0; b < count; b++) {
+                w.inp[b] = inputs[first + b];
+                w.expected[0][b] = labels[first + b][0];
+                w.expected[1][b] = labels[first + b][1];
+            }
+
+            forward(w, count);
+            if (outputs)
+                for (int b = 0; b < count; b++)
+                    outputs[first + b] = {w.out.activation[0][b], w.out.activation[1][b]};
+            backward(w, count);
+        }
+    };
+
+    if (pool && parts > 1) pool->run(parts, part);
+    else for (int t = 0; t < parts; t++) part(t, 0);
+}
+
+void Network::evaluate_batch(Worker &w, const BoardFeatures *inputs, int n, std::array<NumericT, 2> *outputs) {
+    for (int first = 0; first < n; first += MAX_BATCH) {
+        const int count = std::min(MAX_BATCH, n - first);
+        std::copy_n(inputs + first, count, w.inp);
+
+        forward(w, count);
+        for (int b = 0; b < count; b++)
+            outputs[first + b] = {w.out.activation[0][b], w.out.activation[1][b]};
+    }
 }
 
 void Trainer::position_fen(const std::string &fen, const std::string &moves,
@@ -56,6 +321,7 @@ void Trainer::position_fen(const std::string &fen, const std::string &moves,
 
     states = StateListPtr(new std::deque<StateInfo>(1)); // Drop the old state and create a new one
     pos.set(fen, Options["UCI_Chess960"], &states->back(), nullptr);
+    accumulators.reset();
 
     if (!moves.empty()) {
         std::string token;
@@ -66,111 +332,180 @@ void Trainer::position_fen(const std::string &fen, const std::string &moves,
             callback();
 
             states->emplace_back();
-            pos.do_move(m, states->back());
+            do_move(m, states->back());
         }
     }
 
     callback();
 }
 
+namespace {
+// Children of p that train_line_here() chooses from, those with a legal reply, with their features
+void playable_children(Position &p, std::vector<Move> &moves, std::vector<BoardFeatures> &features) {
+    StateInfo st{};
+    for (const auto &mov: MoveList<LEGAL>(p)) {
+        p.do_move(mov, st);
+        if (MoveList<LEGAL>(p).size() > 0) {
+            moves.push_back(mov);
+            encode_features(p, features.emplace_back());
+        }
+        p.undo_move(mov);
+    }
+}
+
+// The move whose [win %, loss %] has the largest win % - loss %, the first of any ties
+template <typename Out>
+Move best_by_eval(const std::vector<Move> &moves, const Out &outputs) {
+    Move bestMove = MOVE_NONE;
+    float bestEval = -std::numeric_limits<float>::infinity();
+    for (std::size_t i = 0; i < moves.size(); i++) {
+        if (float(outputs[i][0] - outputs[i][1]) > bestEval) {
+            bestEval = float(outputs[i][0] - outputs[i][1]);
+            bestMove = moves[i];
+        }
+    }
+    return bestMove;
+}
+}
+
 void Trainer::train_line_here() {
     depth++;
     auto moveList = MoveList<LEGAL>(pos);
     if (moveList.size() == 0) {
-        std::cout << "DEADEND " << pos.fen() << '\n';
+        telemetry::add(telemetry::Counter::DEAD_ENDS);
+        if (telemetry::verbose()) std::cout << "DEADEND " << pos.fen() << '\n';
         depth--;
         return; // no-op on all leaf positions
     }
 
-    train_this_position();
+    ChildLabels harvested;
+    if (harvest_children) {
+        harvested = label_children();
+        train_on(harvested.parent);
+    } else {
+        train_this_position();
+    }
 
     {
         StateInfo st{};
         ASSERT_ALIGNED(&st, Eval::NNUE::CacheLineSize);
 
-        NumericT bestEval = std::numeric_limits<NumericT>::min();
-
-        Move bestMove = *moveList.begin();
-
+        // Queue every non-terminal child with its label, then train on them all and rank them by the
+        // outputs of that same batched forward pass
+        std::vector<Move> children;
+        const std::size_t first = batch_inputs.size();
         for (const auto &mov: moveList) {
 //        auto givesCheck = pos.gives_check(mov);
-            pos.do_move(mov, st);
-
+            do_move(mov, st);
 
             if (MoveList<LEGAL>(pos).size() > 0) {
-                train_this_position();
-
-                NumericT netEval = net->out.activation[0][0] - net->out.activation[1][0];
-                if (netEval > bestEval) {
-                    bestEval = netEval;
-                    bestMove = mov;
-                }
+                const StockfishEval *ev = harvested.find(mov);
+                queue_position(ev ? *ev : stockfish_eval());
+                children.push_back(mov);
             } else {
-                std::cout << "DEADEND-INSEARCH " << pos.fen() << '\n';
+                telemetry::add(telemetry::Counter::DEAD_ENDS);
+                if (telemetry::verbose()) std::cout << "DEADEND-INSEARCH " << pos.fen() << '\n';
             }
 
-            pos.undo_move(mov);
+            undo_move(mov);
         }
 
-        if (bestEval != std::numeric_limits<NumericT>::min()) {
+        // Gradients of the children accumulate until the next apply_backprop(), as before
+        std::vector<std::array<NumericT, 2>> outputs(batch_inputs.size());
+        const int trained = train_batch(outputs.data());
+        if (telemetry::verbose()) std::cout << "d = " << depth << ", trained on " << trained << " children\n";
+
+        // The same rule pick_move() uses; only a position without a playable child ends the line
+        const Move bestMove = best_by_eval(children, outputs.data() + first);
+        if (bestMove != MOVE_NONE) {
 //        auto givesCheck = pos.gives_check(bestMove);
-            std::cout << "Plays " << UCI::move(bestMove, false) << " in " << pos.fen() << '\n';
-            pos.do_move(bestMove, st);
+            if (telemetry::verbose()) std::cout << "Plays " << UCI::move(bestMove, false) << " in " << pos.fen() << '\n';
+            do_move(bestMove, st);
             train_line_here();
-            pos.undo_move(bestMove);
+            undo_move(bestMove);
         } else {
-            std::cout << "DEADEND-NO_SELECTION " << pos.fen() << '\n';
+            telemetry::add(telemetry::Counter::DEAD_ENDS);
+            if (telemetry::verbose()) std::cout << "DEADEND-NO_SELECTION " << pos.fen() << '\n';
         }
     }
 
     depth--;
 }
 
-void Trainer::train_this_position(const std::unordered_map<std::string, StockfishEval> *dataset) {
-    eval_forward();
-
-    std::string fen = clean_fen(pos);
+void Trainer::train_this_position(const EvalCache *cache) {
     StockfishEval ev{};
-    if (dataset != nullptr && dataset->count(fen) > 0)
-        ev = dataset->at(fen);
-    else {
-        std::cout << "Cache miss\n";
+    if (!cache || !cache->probe(label_key(pos), ev)) {
+        telemetry::add(telemetry::Counter::CACHE_MISSES);
+        if (telemetry::verbose()) std::cout << "Cache miss\n";
         ev = stockfish_eval();
     }
 
-    Vec<2> expected = Vec<2>{{{(NumericT)ev.win}, {NumericT(ev.loss)}}};
+    train_on(ev);
+}
 
-    net->hid1.backward(net->hid2.backward(net->hid3.backward(net->hid4.backward(net->out.backward(net->out.init_backwards(expected))))));
+void Trainer::train_on(const StockfishEval &ev) {
+    eval_forward();
 
-    auto outW = net->out.activation[0][0];
-    auto outL = net->out.activation[1][0];
+    Network::Worker &w = net->main_worker();
+    w.expected[0][0] = NumericT(ev.win);
+    w.expected[1][0] = NumericT(ev.loss);
 
-    std::cout << "d = " << depth << ", s = " << net->num_samples << "; outp = " << outW << ' ' << outL
-              << ", real = " << ev.win << ' ' << ev.loss << '\n';
+    if (telemetry::verbose())
+        std::cout << "d = " << depth << ", s = " << w.num_samples << "; outp = " << w.out.activation[0][0] << ' '
+                  << w.out.activation[1][0] << ", real = " << ev.win << ' ' << ev.loss << '\n';
 
-    net->num_samples++;
-    auto err = std::pow(ev.win - outW, 2) + std::pow(ev.loss - outL, 2);
-    net->err += err;
+    net->backward(w, 1);
 
 //    if (net->num_samples > 64)
 //        net->apply_backprop();
 }
 
-StockfishEval Trainer::stockfish_eval() {
-    Search::LimitsType limits;
+namespace {
+// Copy of the states behind p that the search can look back through. Repetitions reach back at
+// most min(rule50, pliesFromNull) plies, so older states are left out.
+StateListPtr copy_history(const Position &p) {
+    std::vector<const StateInfo *> chain;
+    const StateInfo *st = p.state();
+    const int back = std::min(st->rule50, st->pliesFromNull);
+    for (int i = 0; st && i <= back; i++, st = st->previous)
+        chain.push_back(st);
+
+    auto copy = StateListPtr(new std::deque<StateInfo>());
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        StateInfo *prev = copy->empty() ? nullptr : &copy->back();
+        copy->push_back(**it);
+        copy->back().previous = prev;
+    }
+    return copy;
+}
+}
+
+std::ostream &operator<<(std::ostream &os, const LabelTiming &t) {
+    const auto avg = [](double sec, std::uint64_t n) { return n ? sec / double(n) : 0.0; };
+    return os << "label time: " << avg(t.start_sec, t.line_starts) << "s at line starts (" << t.line_starts
+              << "), " << avg(t.continuation_sec, t.continuations) << "s along lines (" << t.continuations
+              << "), mean depth " << avg(double(t.depth_sum), t.line_starts + t.continuations);
+}
 
+StockfishEval Trainer::search_to(Search::LimitsType &limits) {
+    telemetry::ScopedPhase timer{telemetry::Phase::SEARCH};
     limits.startTime = now(); // The search starts as early as possible
-     limits.depth = 16;
-//    limits.nodes = 40000000;
 
     Threads.stop = true;
     Threads.main()->CUSTOM_done.store(false);
 
-    Position cpy{};
-    auto stateCpy = StateListPtr(new std::deque<StateInfo>(1)); // Drop the old state and create a new one
-    cpy.set(pos.fen(), false, &stateCpy->back(), Threads.main());
-
-    Threads.start_thinking(cpy, stateCpy, limits, false);
+    if (search_start == SearchStart::WARM) {
+        // The TT is not cleared between labels, so each ply of a line starts from the tree of the
+        // one before; the history makes repetitions and rule50 draws visible to the search
+        auto history = copy_history(pos);
+        Threads.start_thinking(pos, history, limits, false);
+    } else {
+        Position cpy{};
+        auto stateCpy = StateListPtr(new std::deque<StateInfo>(1)); // Drop the old state and create a new one
+        cpy.set(pos.fen(), false, &stateCpy->back(), Threads.main());
+
+        Threads.start_thinking(cpy, stateCpy, limits, false);
+    }
 
     {
         std::unique_lock<std::mutex> lg(Threads.main()->CUSTOM_mtx);
@@ -184,47 +519,155 @@ StockfishEval Trainer::stockfish_eval() {
     auto wdl_w = win_rate_model( v, ply);
     auto wdl_l = win_rate_model(-v, ply);
 
-    return StockfishEval{wdl_w, wdl_l, v};
+    return StockfishEval{wdl_w, wdl_l, v, int(Threads.main()->completedDepth)};
 }
 
-void Trainer::eval_forward() const {
-    std::size_t i = 0;
-
-    for (Color col : {pos.side_to_move(), ~pos.side_to_move()}) {
-        for (PieceType pt: {PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING}) {
-            Bitboard mask = 1;
+StockfishEval Trainer::stockfish_eval() {
+    const bool continues = pos.state()->previous != nullptr;
+    const auto start = std::chrono::steady_clock::now();
+    const StockfishEval ev = deepen();
 
-            for (int iter = 0; iter < 64; iter++) {
-                net->inp[i++][0] = bb_bool_to_numeric(pos.pieces(pt) & pos.pieces(col) & mask);
-                mask <<= 1;
-            }
-        }
+    label_timing.add(continues, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    label_timing.depth_sum += ev.depth;
+    return ev;
+}
 
-        for (CastlingRights mask : {QUEEN_SIDE, KING_SIDE}) {
-            net->inp[i++][0] = bb_bool_to_numeric(pos.castling_rights(col) & mask);
+StockfishEval Trainer::deepen() {
+    const auto start = std::chrono::steady_clock::now();
+    const auto elapsed_ms = [&] {
+        return int(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+    };
+
+    const LabelBudget &b = budget;
+    std::vector<StockfishEval> evals;
+    std::uint64_t nodes = 0;
+
+    for (int d = b.min_depth; ; d += std::max(b.step, 1)) {
+        Search::LimitsType limits;
+        limits.depth = std::min(d, b.max_depth);
+        if (b.max_nodes) limits.nodes = b.max_nodes - nodes;
+        if (b.max_ms) limits.movetime = std::max(b.max_ms - elapsed_ms(), 1);
+
+        evals.push_back(search_to(limits));
+        nodes += Threads.nodes_searched();
+
+        if (limits.depth >= b.max_depth || evals.back().depth < limits.depth) break; // done or out of budget
+        if ((b.max_nodes && nodes >= b.max_nodes) || (b.max_ms && elapsed_ms() >= b.max_ms)) break;
+
+        // Stable once the last stable_depths labels all lie within tolerance of the newest
+        const int k = std::max(b.stable_depths, 2);
+        if (int(evals.size()) >= k) {
+            const StockfishEval &last = evals.back();
+            bool stable = true;
+            for (int i = int(evals.size()) - k; i < int(evals.size()) - 1; i++)
+                stable &= std::abs(evals[i].win - last.win) <= b.tolerance && std::abs(evals[i].loss - last.loss) <= b.tolerance;
+            if (stable) break;
         }
     }
 
-    Bitboard mask = 1, trans = pos.ep_square() != SQ_NONE ? square_bb(pos.ep_square()) : 0;
-    for (int iter = 0; iter < 64; iter++) {
-        net->inp[i++][0] = bb_bool_to_numeric(trans & mask);
-        mask <<= 1;
+    return evals.back();
+}
+
+ChildLabels Trainer::label_children() {
+    const int moves = int(MoveList<LEGAL>(pos).size());
+    Options["MultiPV"] = std::to_string(std::max(moves, 1));
+
+    // The same adaptive deepening and caps as stockfish_eval(): a MultiPV iteration costs more
+    // than a single-PV one, but a stable parent or a spent budget stops it just the same
+    const auto start = std::chrono::steady_clock::now();
+    ChildLabels res;
+    res.parent = deepen();
+    Options["MultiPV"] = std::string("1");
+
+    // Scores are from pos's side; a child is labeled from its own side to move, one ply later
+    const int child_ply = pos.game_ply() + 1;
+    for (const auto &rm: Threads.main()->rootMoves) {
+        // Picked the way CUSTOM_get_best() picks the parent's: the last completed iteration's score,
+        // replaced by the tablebase score when the root is in the tablebases and v is not a mate
+        Value v = rm.score != -VALUE_INFINITE ? rm.score : rm.previousScore;
+        if (v == -VALUE_INFINITE) continue; // never searched, e.g. after a node or time cap
+        if (Tablebases::RootInTB && std::abs(v) < VALUE_MATE_IN_MAX_PLY) v = rm.tbScore;
+
+        res.children.emplace_back(rm.pv[0], StockfishEval{win_rate_model(-v, child_ply), win_rate_model(v, child_ply),
+                                                          -v, std::max(res.parent.depth - 1, 0)});
     }
 
-    net->inp[i++][0] = pos.rule50_count() / 50.0;
+    label_timing.add(pos.state()->previous != nullptr,
+                     std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    label_timing.depth_sum += res.parent.depth;
+    return res;
+}
+
+void Trainer::queue_position(const StockfishEval &ev) {
+    encode_features(pos, batch_inputs.emplace_back());
+    batch_labels.push_back({NumericT(ev.win), NumericT(ev.loss)});
+}
+
+int Trainer::train_batch(std::array<NumericT, 2> *outputs) {
+    const int n = int(batch_inputs.size());
+    if (n == 0) return 0;
+
+    net->train(batch_inputs.data(), batch_labels.data(), n, pool, outputs);
+
+    batch_inputs.clear();
+    batch_labels.clear();
+    return n;
+}
 
-    net->hid1.forward();
-    net->hid2.forward();
-    net->hid3.forward();
-    net->hid4.forward();
-    net->out.forward();
+void Trainer::eval_forward() {
+    if (accumulators.bound() != &net->hid1)
+        accumulators.bind(&net->hid1);
+
+    // The features are still needed by hid1.backward(), but the sum comes from the accumulators
+    encode_position(0);
+
+    telemetry::ScopedPhase timer{telemetry::Phase::FORWARD};
+    NumericT z[INP_SIZE];
+    accumulators.evaluate(pos, z);
+    Network::Worker &w = net->main_worker();
+    net->hid1.forward_from(w.hid1, z, 0);
+    net->forward_hidden(w, 1);
+}
+
+void Trainer::do_move(Move m, StateInfo &st) {
+    pos.do_move(m, st);
+    accumulators.push(pos);
+}
+
+void Trainer::undo_move(Move m) {
+    pos.undo_move(m);
+    accumulators.pop();
+}
+
+Move Trainer::pick_move() {
+    std::vector<Move> moves;
+    std::vector<BoardFeatures> features;
+    playable_children(pos, moves, features);
+
+    std::vector<std::array<NumericT, 2>> outputs(moves.size());
+    net->evaluate_batch(net->main_worker(), features.data(), int(moves.size()), outputs.data());
+    return best_by_eval(moves, outputs);
+}
+
+Move Trainer::pick_move(const QuantizedNetwork &q) {
+    std::vector<Move> moves;
+    std::vector<BoardFeatures> features;
+    playable_children(pos, moves, features);
+
+    std::vector<std::array<float, 2>> outputs;
+    for (const auto &f: features)
+        outputs.push_back(q.evaluate(f));
+    return best_by_eval(moves, outputs);
+}
 
-    assert(i == INP_SIZE);
+void Trainer::encode_position(int column) const {
+    encode_features(pos, net->main_worker().inp[column]);
 }
 
 Trainer::Trainer() {
     states = StateListPtr(new std::deque<StateInfo>(1));
     pos.set("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", false, &states->back(), nullptr);
+    accumulators.reset();
 }
 
 Trainer::~Trainer() {
@@ -234,6 +677,7 @@ Trainer::~Trainer() {
 void Trainer::position_fen(const std::string &fen) {
     states = StateListPtr(new std::deque<StateInfo>(1)); // Drop the old state and create a new one
     pos.set(fen, false, &states->back(), nullptr);
+    accumulators.reset();
 }
 
 double win_rate_model(Value v, int ply) {
@@ -3,23 +3,45 @@
 #include "position.h"
 #include "uci.h"
 
+#include <array>
+#include <memory>
+#include <vector>
+
+#include "accumulator.hpp"
+#include "features.hpp"
+#include "netfile.hpp"
+#include "worker_pool.hpp"
 #include "nn_linalg.hpp"
 
 using namespace Stockfish;
 
+class QuantizedNetwork;
+class EvalCache;
+
+constexpr auto L2_SIZE = 32768; // 16384;
 
 /**
- * Number of input layers:
- * 64 boardsize * 6 piece types * 2 sides
- *      PLUS
- * 64 possible en passant squares
- *      PLUS
- * 4 castling rights
- *      PLUS
- * 1 halfmove clock percentage (scales from 0 to 1, hits 1 at 50 halfmoves)
+ * Maximum number of positions the network can process at once. Each position occupies one column
+ * of every per-sample buffer, so forward and backward passes over a batch are GEMMs instead of GEMVs.
  */
-constexpr auto INP_SIZE = 64*6*2 + 64 + 4 + 1;
-constexpr auto L2_SIZE = 32768; // 16384;
+constexpr int MAX_BATCH = 64;
+
+template <int InpNo, int OutNo>
+using NetLayer = Layer<InpNo, OutNo, SigmoidActivation<NumericT>, MAX_BATCH>;
+
+// What hid2 and hid3, which hold nearly all of the weights, are read in; set with NN_WIDE_WEIGHTS
+#if defined(NN_WIDE_BF16)
+using WideStoreT = bf16;
+#elif defined(NN_WIDE_FP16)
+using WideStoreT = fp16;
+#else
+using WideStoreT = NumericT;
+#endif
+
+template <int InpNo, int OutNo>
+using WideLayer = Layer<InpNo, OutNo, SigmoidActivation<NumericT>, MAX_BATCH, WideStoreT>;
+
+using InputLayer = SparseLayer<BoardFeatures, INP_SIZE, SigmoidActivation<NumericT>, MAX_BATCH>;
 
 
 /**
@@ -31,23 +53,86 @@ constexpr auto L2_SIZE = 32768; // 16384;
 
 class Network {
 public:
-    NumericT err = 0;
-    unsigned epoch = 0, num_samples = 0;
+    using Hid2 = WideLayer<INP_SIZE, L2_SIZE>;
+    using Hid3 = WideLayer<L2_SIZE, 512>;
+    using Hid4 = NetLayer<512, 64>;
+    using Out = NetLayer<64, 2>;
+
+    constexpr static Arena::Footprint footprint = Arena::sum(
+            InputLayer::footprint, Hid2::footprint, Hid3::footprint, Hid4::footprint, Out::footprint);
+
+    /**
+     * Everything one thread writes while training: per-sample buffers and its own gradient
+     * accumulators. Every worker carves its arena in the same order, so the gradient sections of
+     * all workers have the same layout and can be summed as flat arrays.
+     */
+    struct Worker {
+        constexpr static Arena::Footprint footprint = Arena::sum(
+                InputLayer::Grads::footprint, InputLayer::State::footprint,
+                Hid2::Grads::footprint, Hid2::State::footprint,
+                Hid3::Grads::footprint, Hid3::State::footprint,
+                Hid4::Grads::footprint, Hid4::State::footprint,
+                Out::Grads::footprint, Out::State::footprint,
+                Arena::footprint_of<NumericT, 2, MAX_BATCH>(Arena::STATE, 2));
+
+        Arena arena{footprint};
+
+        InputLayer::Grads hid1_grads{arena};
+        Hid2::Grads hid2_grads{arena};
+        Hid3::Grads hid3_grads{arena};
+        Hid4::Grads hid4_grads{arena};
+        Out::Grads out_grads{arena};
+
+        BoardFeatures inp[MAX_BATCH]{};
+        InputLayer::State hid1{arena};
+        Hid2::State hid2{arena};
+        Hid3::State hid3{arena};
+        Hid4::State hid4{arena};
+        Out::State out{arena};
+
+        // Labels for backward(), one column per sample, and the derivative of the cost against them
+        Mat<2, MAX_BATCH> expected = arena.take<NumericT, 2, MAX_BATCH>(Arena::STATE);
+        Mat<2, MAX_BATCH> dCost_dOut = arena.take<NumericT, 2, MAX_BATCH>(Arena::STATE);
+
+        NumericT err = 0;
+        unsigned num_samples = 0;
+
+        Worker() {
+            hid1.input = inp;
+            hid2.input = hid1.activation;
+            hid3.input = hid2.activation;
+            hid4.input = hid3.activation;
+            out.input = hid4.activation;
+        }
+
+        Worker(const Worker &) = delete;
+        Worker &operator=(const Worker &) = delete;
+    };
+
+    unsigned epoch = 0;
 
-    Vec<INP_SIZE> inp{};
-    Layer<INP_SIZE, INP_SIZE> hid1;
-    Layer<INP_SIZE, L2_SIZE> hid2;
-    Layer<L2_SIZE, 512> hid3;
-    Layer<512, 64> hid4;
-    Layer<64, 2> out;
+    // Every parameter lives in here; it must be declared before the layers
+    Arena arena{footprint};
+
+    InputLayer hid1{arena};
+    Hid2 hid2{arena};
+    Hid3 hid3{arena};
+    Hid4 hid4{arena};
+    Out out{arena};
+
+    // workers[i] trains share i of every batch; there are never more than threads and workers[0] always exists
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    Optimizer optimizer;
+    LearnSchedule schedule = constant_schedule();
+    std::uint64_t steps = 0; // apply_backprop() calls, kept with the optimizer state
+
+    // Optimizer state: slot s of the parameter at float i of the arena's PARAMS section is at s * params + i
+    std::vector<NumericT> moments;
 
     Network() {
         std::cout << "NET CTOR\n";
-        hid1.input = &inp;
-        hid2.input = &hid1.activation;
-        hid3.input = &hid2.activation;
-        hid4.input = &hid3.activation;
-        out.input = &hid4.activation;
+        workers.emplace_back(std::make_unique<Worker>());
 
         hid1.randomize();
         hid2.randomize();
@@ -56,22 +141,129 @@ public:
         out.randomize();
     }
 
+    // The layers hold views into arena
+    Network(const Network &) = delete;
+    Network &operator=(const Network &) = delete;
+
+    // Worker used by single-threaded callers
+    Worker &main_worker() { return *workers.front(); }
+
+    // Atomically write the parameters in the versioned network file format
     void save(const std::string &file = "net2.nn");
-    void load(const std::string &file = "net2.nn");
 
-    void apply_backprop();
+    // Hand a copy of the parameters to cp, which writes it in the background; false if cp was still busy
+    bool checkpoint(Checkpointer &cp) const;
+
+    // Load a network file, or a headerless file from before the format existed; keeps the current weights on failure
+    bool load(const std::string &file = "net2.nn");
+
+    [[nodiscard]] NetFileHeader file_header() const;
+
+    // Switch to o with fresh moments; call before load() to resume the state saved with a checkpoint
+    void set_optimizer(const Optimizer &o);
+
+    // Sum the gradients of every worker, in parallel if a pool is given, and take one step with them
+    void apply_backprop(WorkerPool *pool = nullptr);
+
+    // Run the first n columns of w.inp through the network
+    void forward(Worker &w, int n = 1);
+
+    // Run the first n columns through every layer after hid1, whose activations in w must already be set
+    void forward_hidden(Worker &w, int n = 1);
+
+    // Accumulate the gradient of the first n samples of the last forward() against the first n columns of w.expected
+    void backward(Worker &w, int n = 1);
+
+    /**
+     * Forward and backward n labelled samples, split into one share per thread of pool, each on its
+     * own Worker and MAX_BATCH at a time. Gradients stay in the workers until apply_backprop(), so
+     * the forward outputs, stored to outputs[0..n) if given, are what evaluate_batch() would return.
+     */
+    void train(const BoardFeatures *inputs, const std::array<NumericT, 2> *labels, int n, WorkerPool *pool = nullptr,
+               std::array<NumericT, 2> *outputs = nullptr);
+
+    /**
+     * Outputs for n positions, MAX_BATCH columns per forward pass, written to outputs[0..n). Only
+     * w's per-sample buffers are touched; nothing is kept for backward() and no gradient changes.
+     */
+    void evaluate_batch(Worker &w, const BoardFeatures *inputs, int n, std::array<NumericT, 2> *outputs);
+
+private:
+    bool load_legacy(std::ifstream &fd, const std::string &file);
+
+    [[nodiscard]] OptimFileHeader optim_header() const;
+
+    // Restore the moments and step count saved alongside the network file with the given checksum
+    bool load_optimizer(const std::string &file, std::uint64_t param_checksum);
+
+    void reduce_gradients(WorkerPool *pool);
 };
 
 struct StockfishEval {
     double win, loss;
     Stockfish::Value eval;
+    int depth = 0; // depth the search completed, 0 if unknown
 };
 
-inline std::string clean_fen(Position &p) {
+/**
+ * When stockfish_eval() and label_children() stop deepening. They search min_depth, then one step deeper at a time,
+ * reusing the TT, and stops once win and loss moved by at most tolerance over the last
+ * stable_depths depths, at max_depth, or when a cap runs out. min_depth == max_depth is a
+ * single fixed-depth search.
+ */
+struct LabelBudget {
+    int min_depth = 8, max_depth = 16, step = 1;
+    int stable_depths = 3;
+    double tolerance = 0.02;
+    std::uint64_t max_nodes = 0; // per position, 0 for no cap
+    int max_ms = 0;              // per position, 0 for no cap
+};
+
+inline std::string clean_fen(const Position &p) {
     std::string cleanFen = p.fen();
     return cleanFen.substr(0, cleanFen.rfind(' ', cleanFen.rfind(' ') - 1));
 }
 
+// How stockfish_eval() hands pos to the search
+enum class SearchStart {
+    COLD, // a fresh Position from pos.fen(): no move history, so no repetition detection
+    WARM, // pos with its move history, so the search sees repetitions and plies from null
+};
+
+// The one default: Trainer starts with it and the label generators pass it on unless told otherwise
+constexpr SearchStart DEFAULT_SEARCH_START = SearchStart::WARM;
+
+/**
+ * Search time per label, split by whether the position starts a line or continues one. Both
+ * SearchStart modes keep the TT between labels, so the two averages differ in either mode; what
+ * WARM saves over COLD is timed on identical lines by NNStockChessBench's "stockfish_eval line".
+ */
+struct LabelTiming {
+    std::uint64_t line_starts = 0, continuations = 0;
+    double start_sec = 0, continuation_sec = 0;
+    std::uint64_t depth_sum = 0; // of the depths labels were taken at
+
+    void add(bool continues, double sec) {
+        (continues ? continuations : line_starts)++;
+        (continues ? continuation_sec : start_sec) += sec;
+    }
+
+};
+
+std::ostream &operator<<(std::ostream &os, const LabelTiming &t);
+
+// Labels of a position and of each of its children, all from one MultiPV search
+struct ChildLabels {
+    StockfishEval parent{};
+    std::vector<std::pair<Move, StockfishEval>> children;
+
+    [[nodiscard]] const StockfishEval *find(Move m) const {
+        for (const auto &[move, ev]: children)
+            if (move == m) return &ev;
+        return nullptr;
+    }
+};
+
 class Trainer {
 public:
     std::unique_ptr<Network> net; // = std::make_unique<Network>();
@@ -79,8 +271,25 @@ public:
     Position pos{};
     StateListPtr states{new std::deque<StateInfo>(1)};
 
+    // First-layer sums along the current line, kept in step with pos by do_move()/undo_move()
+    AccumulatorStack<InputLayer> accumulators;
+
     int depth = 0;
 
+    SearchStart search_start = DEFAULT_SEARCH_START;
+    LabelBudget budget;
+
+    // Label the children in train_line_here() with label_children() instead of a search each
+    bool harvest_children = false;
+    LabelTiming label_timing;
+
+    // Positions queued with queue_position() and their labels
+    std::vector<BoardFeatures> batch_inputs;
+    std::vector<std::array<NumericT, 2>> batch_labels;
+
+    // Threads train_batch() spreads the batch over; single-threaded if null
+    WorkerPool *pool = nullptr;
+
     Trainer();
     ~Trainer();
 
@@ -88,11 +297,44 @@ public:
 
     void train_line_here();
 
-    void train_this_position(const std::unordered_map<std::string, StockfishEval> *dataset = nullptr);
+    void train_this_position(const EvalCache *cache = nullptr);
+
+    // Forward pos and backpropagate its error against ev
+    void train_on(const StockfishEval &ev);
 
+    // Label pos with the search, deepening within budget
     StockfishEval stockfish_eval();
 
-    void eval_forward() const;
+    // One search of pos with the given limits
+    StockfishEval search_to(Search::LimitsType &limits);
+
+    // Searches of pos one budget step deeper at a time, until the label is stable or the budget
+    // is spent; the last search's root moves are left in Threads.main()
+    StockfishEval deepen();
+
+    // Deepen within budget with a PV for every legal move, and turn each root move's score into a
+    // label of the child it leads to (searched one ply shallower)
+    ChildLabels label_children();
+
+    void eval_forward();
+
+    // pos.do_move()/pos.undo_move() that also update the accumulators
+    void do_move(Move m, StateInfo &st);
+    void undo_move(Move m);
+
+    // Child of pos that train_line_here() would play (MOVE_NONE if there is none), ranked by the
+    // float network or by q
+    Move pick_move();
+    Move pick_move(const QuantizedNetwork &q);
+
+    // Write the input features of pos into the given column of the main worker's inputs
+    void encode_position(int column = 0) const;
+
+    // Add pos to the pending batch with the given label
+    void queue_position(const StockfishEval &ev);
+
+    // Forward and backward the pending batch, returning the number of samples trained on; see Network::train()
+    int train_batch(std::array<NumericT, 2> *outputs = nullptr);
 
     void position_fen(const std::string &fen);
 };
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed set of threads running parallel-for style jobs. The calling thread takes part as thread 0,
+ * so a pool of size 1 runs everything inline. Not to be confused with Stockfish's search Threads.
+ */
+class WorkerPool {
+public:
+    explicit WorkerPool(int threads = int(std::thread::hardware_concurrency())) {
+        for (int t = 1; t < std::max(threads, 1); t++)
+            helpers.emplace_back([this, t] { loop(t); });
+    }
+
+    ~WorkerPool() {
+        {
+            std::unique_lock<std::mutex> lg(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto &th : helpers)
+            th.join();
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    [[nodiscard]] int size() const {
+        return int(helpers.size()) + 1;
+    }
+
+    // Call fn(task, thread) for every task in [0, tasks), spread over the pool; returns when all are done
+    void run(int tasks, const std::function<void(int task, int thread)> &fn) {
+        if (tasks <= 0) return;
+
+        {
+            std::unique_lock<std::mutex> lg(mtx);
+            job = &fn;
+            num_tasks = tasks;
+            next_task.store(0);
+            busy = int(helpers.size());
+            generation++;
+        }
+        cv.notify_all();
+
+        work(0);
+
+        std::unique_lock<std::mutex> lg(mtx);
+        done_cv.wait(lg, [this] { return busy == 0; });
+        job = nullptr;
+    }
+
+private:
+    std::vector<std::thread> helpers;
+    std::mutex mtx;
+    std::condition_variable cv, done_cv;
+    const std::function<void(int, int)> *job = nullptr;
+    int num_tasks = 0, busy = 0;
+    unsigned generation = 0;
+    bool stopping = false;
+    std::atomic<int> next_task{0};
+
+    void work(int thread) {
+        for (int task; (task = next_task.fetch_add(1)) < num_tasks; )
+            (*job)(task, thread);
+    }
+
+    void loop(int thread) {
+        unsigned seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lg(mtx);
+                cv.wait(lg, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+
+            work(thread);
+
+            std::unique_lock<std::mutex> lg(mtx);
+            if (--busy == 0)
+                done_cv.notify_all();
+        }
+    }
+};
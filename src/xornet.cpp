@@ -7,12 +7,27 @@
 #include <iostream>
 
 void xornet() {
-    Vec<2> input;
-    Layer<2, 2> hidden1;
-    Layer<2, 1> output;
-
-    hidden1.input = &input;
-    output.input = &hidden1.activation;
+    using Hidden = Layer<2, 2>;
+    using Output = Layer<2, 1>;
+
+    Arena arena{Arena::sum(Hidden::footprint, Output::footprint,
+                           Hidden::Grads::footprint, Output::Grads::footprint,
+                           Hidden::State::footprint, Output::State::footprint,
+                           Arena::footprint_of<NumericT, 2, 1>(Arena::STATE),
+                           Arena::footprint_of<NumericT, 1, 1>(Arena::STATE, 2))};
+
+    Vec<2> input = arena.take<NumericT, 2, 1>(Arena::STATE);
+    Vec<1> desired = arena.take<NumericT, 1, 1>(Arena::STATE);
+    Vec<1> dCdA = arena.take<NumericT, 1, 1>(Arena::STATE);
+    Hidden hidden1{arena};
+    Output output{arena};
+    Hidden::Grads hidden1_grads{arena};
+    Output::Grads output_grads{arena};
+    Hidden::State hidden1_state{arena};
+    Output::State output_state{arena};
+
+    hidden1_state.input = input;
+    output_state.input = hidden1_state.activation;
 
     hidden1.weights.randomize();
     hidden1.biases.randomize();
@@ -30,18 +45,20 @@ void xornet() {
                 }
 
                 auto ddes = static_cast<NumericT>(a ^ b);
-                auto desired = Vec<1>{{{ddes}}};
+                desired[0][0] = ddes;
 
-                input = {{{(NumericT) a}, {(NumericT) b}}};
-                hidden1.forward();
-                output.forward();
+                input[0][0] = (NumericT) a;
+                input[1][0] = (NumericT) b;
+                hidden1.forward(hidden1_state);
+                output.forward(output_state);
 
-                hidden1.backward(output.backward(output.init_backwards(desired)));
+                output.init_backwards(output_state, desired, dCdA);
+                hidden1.backward(hidden1_state, hidden1_grads, output.backward(output_state, output_grads, dCdA));
 
-                err += std::pow(output.activation[0][0] - ddes, 2);
+                err += std::pow(output_state.activation[0][0] - ddes, 2);
 
                 if (iter > 4040) {
-                    std::cout << a << " ^ " << b << " = " << output.activation[0][0] << '\n';
+                    std::cout << a << " ^ " << b << " = " << output_state.activation[0][0] << '\n';
                 }
             }
         }
@@ -52,10 +69,10 @@ void xornet() {
             break;
 
         if (rng(0) > 0.125)
-            output.apply_backprop();
+            output.apply_backprop(output_grads);
 
         if (rng(0) > 0.125)
-            hidden1.apply_backprop();
+            hidden1.apply_backprop(hidden1_grads);
     }
 
     std::cout << output.weights.to_string() << '\n';